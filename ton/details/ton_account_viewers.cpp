@@ -10,6 +10,7 @@
 #include "ton/ton_wallet.h"
 #include "ton/ton_account_viewer.h"
 #include "ton/details/ton_storage.h"
+#include "ton/details/ton_address.h"
 #include "ton/details/ton_parse_state.h"
 #include "storage/cache/storage_cache_database.h"
 
@@ -17,14 +18,25 @@ namespace Ton::details {
 namespace {
 
 constexpr auto kRefreshWithPendingTimeout = 6 * crl::time(1000);
+constexpr auto kSaveStateDelay = crl::time(500);
+constexpr auto kClosedStatesLimit = 16;
+constexpr auto kInvalidAddress = "INVALID_ACCOUNT_ADDRESS";
 
 std::vector<PendingTransaction> ComputePendingTransactions(
 		std::vector<PendingTransaction> list,
 		const AccountState &state,
 		const TransactionsSlice &last) {
+	const auto found = [&](const Transaction &fake) {
+		return ranges::any_of(last.list, [&](const Transaction &real) {
+			return (real == fake)
+				&& SameAddress(
+					real.incoming.destination,
+					fake.incoming.destination);
+		});
+	};
 	const auto processed = [&](const PendingTransaction &transaction) {
 		return (transaction.sentUntilSyncTime < state.syncTime)
-			|| (ranges::find(last.list, transaction.fake) != end(last.list));
+			|| found(transaction.fake);
 	};
 	list.erase(ranges::remove_if(list, processed), end(list));
 	return list;
@@ -39,10 +51,12 @@ AccountViewers::AccountViewers(
 : _owner(owner)
 , _lib(lib)
 , _db(db)
-, _refreshTimer([=] { checkNextRefresh(); }) {
+, _refreshTimer([=] { checkNextRefresh(); })
+, _saveTimer([=] { flushSaves(); }) {
 }
 
 AccountViewers::~AccountViewers() {
+	flushSaves();
 	for (const auto &[address, viewers] : _map) {
 		Assert(viewers.list.empty());
 	}
@@ -53,16 +67,42 @@ rpl::producer<BlockchainTime> AccountViewers::blockchainTime() const {
 }
 
 AccountViewers::Viewers *AccountViewers::findRefreshingViewers(
-		const QString &address) {
+		const Address &address) {
 	const auto i = _map.find(address);
 	Assert(i != end(_map));
 	if (i->second.list.empty()) {
+		rememberClosed(i->second);
 		_map.erase(i);
 		return nullptr;
 	}
 	return &i->second;
 }
 
+void AccountViewers::rememberClosed(const Viewers &viewers) {
+	if (!viewers.lastRefreshFinished) {
+		// Nothing was loaded yet, the database has the same.
+		return;
+	}
+	const auto i = ranges::find(_closed, viewers.raw, &ClosedState::address);
+	if (i != end(_closed)) {
+		_closed.erase(i);
+	} else if (int(_closed.size()) == kClosedStatesLimit) {
+		_closed.erase(begin(_closed));
+	}
+	_closed.push_back({ viewers.raw, viewers.state.current() });
+}
+
+std::optional<WalletState> AccountViewers::takeClosed(
+		const Address &address) {
+	const auto i = ranges::find(_closed, address, &ClosedState::address);
+	if (i == end(_closed)) {
+		return std::nullopt;
+	}
+	auto result = std::move(i->state);
+	_closed.erase(i);
+	return result;
+}
+
 void AccountViewers::finishRefreshing(Viewers &viewers, Result<> result) {
 	viewers.lastRefreshFinished = crl::now();
 	if (result) {
@@ -99,7 +139,7 @@ void AccountViewers::saveNewState(
 	}
 	if (viewers.state.current() != state) {
 		if (source != RefreshSource::Database) {
-			SaveWalletState(_db, state, nullptr);
+			saveLater(viewers.raw, viewers.state.current(), state);
 		}
 		viewers.state = std::move(state);
 		if (!weak) {
@@ -107,14 +147,41 @@ void AccountViewers::saveNewState(
 		}
 	}
 	if (source == RefreshSource::Database) {
-		refreshAccount(state.address, viewers);
+		refreshAccount(viewers);
 	} else {
 		checkNextRefresh();
 	}
 }
 
+void AccountViewers::saveLater(
+		const Address &address,
+		const WalletState &stored,
+		const WalletState &state) {
+	const auto i = _unsaved.find(address);
+	if (i != end(_unsaved)) {
+		i->second.latest = state;
+	} else {
+		_unsaved.emplace(address, UnsavedState{ stored, state });
+	}
+	if (!_saveTimer.isActive()) {
+		_saveTimer.callOnce(kSaveStateDelay);
+	}
+}
+
+void AccountViewers::flushSave(const Address &address) {
+	if (auto unsaved = _unsaved.take(address)) {
+		SaveWalletState(_db, unsaved->latest, unsaved->stored, nullptr);
+	}
+}
+
+void AccountViewers::flushSaves() {
+	_saveTimer.cancel();
+	for (const auto &[address, unsaved] : base::take(_unsaved)) {
+		SaveWalletState(_db, unsaved.latest, unsaved.stored, nullptr);
+	}
+}
+
 void AccountViewers::checkPendingForSameState(
-		const QString &address,
 		Viewers &viewers,
 		const AccountState &state) {
 	auto pending = ComputePendingTransactions(
@@ -124,7 +191,7 @@ void AccountViewers::checkPendingForSameState(
 	if (viewers.state.current().pendingTransactions != pending) {
 		// Some pending transactions were discarded by the sync time.
 		saveNewState(viewers, WalletState{
-			address,
+			viewers.address,
 			state,
 			viewers.state.current().lastTransactions,
 			std::move(pending)
@@ -135,51 +202,89 @@ void AccountViewers::checkPendingForSameState(
 	}
 }
 
-void AccountViewers::refreshAccount(
-		const QString &address,
-		Viewers &viewers) {
+void AccountViewers::refreshAccount(Viewers &viewers) {
 	const auto requested = crl::now();
+	const auto address = viewers.raw;
 	viewers.refreshing = true;
-	_owner->requestState(address, [=](Result<AccountState> result) {
-		const auto viewers = findRefreshingViewers(address);
-		if (!viewers || reportError(*viewers, result)) {
-			return;
+	_owner->requestState(viewers.address, [=](Result<AccountState> result) {
+		stateReceived(address, requested, std::move(result));
+	});
+}
+
+void AccountViewers::refreshAccounts(std::vector<Address> addresses) {
+	if (addresses.size() == 1) {
+		const auto i = _map.find(addresses.front());
+		if (i != end(_map)) {
+			refreshAccount(i->second);
 		}
-		const auto &state = *result;
-		if (LocalTimeSyncer::IsRequestFastEnough(requested, crl::now())) {
-			_blockchainTime.fire({ requested, TimeId(state.syncTime) });
+		return;
+	}
+	const auto requested = crl::now();
+	const auto weak = base::make_weak(this);
+	auto formatted = std::vector<QString>();
+	formatted.reserve(addresses.size());
+	for (const auto &address : addresses) {
+		const auto i = _map.find(address);
+		Assert(i != end(_map));
+		formatted.push_back(i->second.address);
+		i->second.refreshing = true;
+		if (!weak) {
+			return;
 		}
-		if (state == viewers->state.current().account) {
-			checkPendingForSameState(address, *viewers, state);
+	}
+	// Each state is handled as soon as it arrives,
+	// so a slow account doesn't hold back the others.
+	_owner->requestStates(formatted, crl::guard(this, [=](
+			int index,
+			Result<AccountState> result) {
+		Expects(index >= 0 && index < int(addresses.size()));
+
+		stateReceived(addresses[index], requested, std::move(result));
+	}));
+}
+
+void AccountViewers::stateReceived(
+		const Address &address,
+		crl::time requested,
+		Result<AccountState> result) {
+	const auto viewers = findRefreshingViewers(address);
+	if (!viewers || reportError(*viewers, result)) {
+		return;
+	}
+	const auto &state = *result;
+	if (LocalTimeSyncer::IsRequestFastEnough(requested, crl::now())) {
+		_blockchainTime.fire({ requested, TimeId(state.syncTime) });
+	}
+	if (state == viewers->state.current().account) {
+		checkPendingForSameState(*viewers, state);
+		return;
+	}
+	const auto received = [=](Result<TransactionsSlice> result) {
+		const auto viewers = findRefreshingViewers(address);
+		if (!viewers || reportError(*viewers, result)) {
 			return;
 		}
-		const auto received = [=](Result<TransactionsSlice> result) {
-			const auto viewers = findRefreshingViewers(address);
-			if (!viewers || reportError(*viewers, result)) {
-				return;
-			}
-			saveNewStateEncrypted(
-				address,
-				*viewers,
-				WalletState{
-					address,
-					state,
-					std::move(*result) },
-				RefreshSource::Remote);
-		};
-		_owner->requestTransactions(
-			viewers->publicKey,
-			address,
-			state.lastTransactionId,
-			received);
-	});
+		saveNewStateEncrypted(
+			*viewers,
+			WalletState{
+				viewers->address,
+				state,
+				std::move(*result) },
+			RefreshSource::Remote);
+	};
+	_owner->requestTransactions(
+		viewers->publicKey,
+		viewers->address,
+		state.lastTransactionId,
+		received);
 }
 
 void AccountViewers::saveNewStateEncrypted(
-		const QString &address,
 		Viewers &viewers,
 		WalletState &&full,
 		RefreshSource source) {
+	const auto address = viewers.raw;
+	const auto formatted = viewers.address;
 	auto &last = full.lastTransactions;
 	const auto &existingPending = full.pendingTransactions;
 	const auto &state = full.account;
@@ -191,7 +296,7 @@ void AccountViewers::saveNewStateEncrypted(
 				state,
 				last);
 		saveNewState(viewers, WalletState{
-			address,
+			formatted,
 			state,
 			std::move(last),
 			std::move(pending)
@@ -213,6 +318,7 @@ void AccountViewers::saveNewStateEncrypted(
 void AccountViewers::checkNextRefresh() {
 	constexpr auto kNoRefresh = std::numeric_limits<crl::time>::max();
 	auto minWait = kNoRefresh;
+	auto refresh = std::vector<Address>();
 	const auto now = crl::now();
 	for (auto &[address, viewers] : _map) {
 		if (viewers.refreshing.current()) {
@@ -232,7 +338,7 @@ void AccountViewers::checkNextRefresh() {
 			= viewers.lastRefreshFinished + use;
 		const auto in = next - now;
 		if (in <= 0) {
-			refreshAccount(address, viewers);
+			refresh.push_back(address);
 			continue;
 		}
 		if (minWait > in) {
@@ -242,32 +348,57 @@ void AccountViewers::checkNextRefresh() {
 	if (minWait != kNoRefresh) {
 		_refreshTimer.callOnce(minWait);
 	}
+	if (!refresh.empty()) {
+		refreshAccounts(std::move(refresh));
+	}
 }
 
-void AccountViewers::refreshFromDatabase(
-		const QString &address,
-		Viewers &viewers) {
+void AccountViewers::refreshFromDatabase(Viewers &viewers) {
+	const auto address = viewers.raw;
+	const auto formatted = viewers.address;
+
 	viewers.refreshing = true;
+	if (auto closed = takeClosed(address)) {
+		// Already decoded and decrypted, newer than the database.
+		saveNewState(viewers, std::move(*closed), RefreshSource::Database);
+		return;
+	}
+
+	if (auto preloaded = _preloaded.take(address)) {
+		saveNewStateEncrypted(
+			viewers,
+			std::move(*preloaded),
+			RefreshSource::Database);
+		return;
+	}
+
+	// Database requests are done in order, so the read sees the write.
+	flushSave(address);
+
 	auto loaded = [=](Result<WalletState> result) {
 		const auto viewers = findRefreshingViewers(address);
 		if (!viewers) {
 			return;
 		}
 		saveNewStateEncrypted(
-			address,
 			*viewers,
-			result.value_or(WalletState{ address }),
+			result.value_or(WalletState{ formatted }),
 			RefreshSource::Database);
 	};
-	LoadWalletState(_db, address, crl::guard(this, loaded));
+	LoadWalletState(_db, formatted, this, loaded);
 }
 
 std::unique_ptr<AccountViewer> AccountViewers::createAccountViewer(
 		const QByteArray &publicKey,
 		const QString &address) {
+	const auto parsed = ParseAddress(address);
+	if (!parsed) {
+		return createInvalidViewer(publicKey, address);
+	}
+	const auto key = parsed->raw;
 	const auto i = _map.emplace(
-		address,
-		Viewers{ publicKey, WalletState{ address } }
+		key,
+		Viewers{ publicKey, address, key, WalletState{ address } }
 	).first;
 
 	auto &viewers = i->second;
@@ -288,14 +419,14 @@ std::unique_ptr<AccountViewer> AccountViewers::createAccountViewer(
 
 	if (!viewers.nextRefresh) {
 		viewers.nextRefresh = raw->refreshEach();
-		refreshFromDatabase(address, viewers);
+		refreshFromDatabase(viewers);
 	}
 
 	raw->refreshEachValue(
 	) | rpl::start_with_next_done([=] {
 		checkNextRefresh();
 	}, [=] {
-		const auto i = _map.find(address);
+		const auto i = _map.find(key);
 		Assert(i != end(_map));
 		i->second.list.erase(
 			ranges::remove(
@@ -304,27 +435,64 @@ std::unique_ptr<AccountViewer> AccountViewers::createAccountViewer(
 				&not_null<AccountViewer*>::get),
 			end(i->second.list));
 		if (i->second.list.empty() && !i->second.refreshing.current()) {
+			rememberClosed(i->second);
 			_map.erase(i);
 		}
 	}, viewers.lifetime);
 
 	raw->refreshNowRequests(
 	) | rpl::start_with_next([=](Callback<> &&done) {
-		const auto i = _map.find(address);
+		const auto i = _map.find(key);
 		Assert(i != end(_map));
 		i->second.refreshed = std::move(done);
 		if (!i->second.refreshing.current()) {
-			refreshAccount(address, i->second);
+			refreshAccount(i->second);
 		}
 	}, viewers.lifetime);
 
 	return result;
 }
 
+std::unique_ptr<AccountViewer> AccountViewers::createInvalidViewer(
+		const QByteArray &publicKey,
+		const QString &address) {
+	// Nothing to load or refresh, each refresh fails right away.
+	auto result = std::make_unique<AccountViewer>(
+		_owner,
+		publicKey,
+		address,
+		rpl::single(WalletViewerState{ WalletState{ address } }));
+	result->refreshNowRequests(
+	) | rpl::start_with_next([=](Callback<> &&done) {
+		InvokeCallback(done, Error{ Error::Type::TonLib, kInvalidAddress });
+	}, _lifetime);
+	return result;
+}
+
+void AccountViewers::preloadStates(const std::vector<QString> &addresses) {
+	for (const auto &formatted : addresses) {
+		const auto parsed = ParseAddress(formatted);
+		if (!parsed || _map.find(parsed->raw) != end(_map)) {
+			continue;
+		}
+		const auto address = parsed->raw;
+		auto loaded = [=](WalletState &&state) {
+			// Live or closed viewers have a newer state already.
+			if (_map.find(address) != end(_map)
+				|| ranges::contains(_closed, address, &ClosedState::address)) {
+				return;
+			}
+			_preloaded[address] = std::move(state);
+		};
+		flushSave(address);
+		LoadWalletState(_db, formatted, this, loaded);
+	}
+}
+
 void AccountViewers::addPendingTransaction(
 		const PendingTransaction &pending) {
-	const auto address = pending.fake.incoming.destination;
-	const auto i = _map.find(address);
+	const auto parsed = ParseAddress(pending.fake.incoming.destination);
+	const auto i = parsed ? _map.find(parsed->raw) : end(_map);
 	if (i != end(_map)) {
 		auto state = i->second.state.current();
 		state.pendingTransactions.insert(
@@ -39,11 +39,20 @@ public:
 		const QString &address);
 	void addPendingTransaction(const PendingTransaction &pending);
 
+	// Loads the stored states, so that viewers created later get them
+	// without waiting for the database.
+	void preloadStates(const std::vector<QString> &addresses);
+
+	// Writes the merged changes right away, for direct database reads.
+	void flushSaves();
+
 	[[nodiscard]] rpl::producer<BlockchainTime> blockchainTime() const;
 
 private:
 	struct Viewers {
 		QByteArray publicKey;
+		QString address;
+		Address raw;
 		rpl::variable<WalletState> state;
 		rpl::variable<crl::time> lastGoodRefresh = 0;
 		rpl::variable<bool> refreshing = false;
@@ -59,19 +68,33 @@ private:
 		Pending,
 	};
 
-	void refreshFromDatabase(const QString &address, Viewers &viewers);
-	void refreshAccount(const QString &address, Viewers &viewers);
+	// Changes of a wallet state are merged and written at once.
+	struct UnsavedState {
+		WalletState stored;
+		WalletState latest;
+	};
+
+	struct ClosedState {
+		Address address;
+		WalletState state;
+	};
+
+	void refreshFromDatabase(Viewers &viewers);
+	void refreshAccount(Viewers &viewers);
+	void refreshAccounts(std::vector<Address> addresses);
+	void stateReceived(
+		const Address &address,
+		crl::time requested,
+		Result<AccountState> result);
 	void checkPendingForSameState(
-		const QString &address,
 		Viewers &viewers,
 		const AccountState &state);
 	void checkNextRefresh();
-	Viewers *findRefreshingViewers(const QString &address);
+	Viewers *findRefreshingViewers(const Address &address);
 	void finishRefreshing(Viewers &viewers, Result<> result = {});
 	template <typename Data>
 	bool reportError(Viewers &viewers, Result<Data> result);
 	void saveNewStateEncrypted(
-		const QString &address,
 		Viewers &viewers,
 		WalletState &&full,
 		RefreshSource source);
@@ -79,17 +102,39 @@ private:
 		Viewers &viewers,
 		WalletState &&state,
 		RefreshSource source);
+	void rememberClosed(const Viewers &viewers);
+	[[nodiscard]] std::optional<WalletState> takeClosed(
+		const Address &address);
+	[[nodiscard]] std::unique_ptr<AccountViewer> createInvalidViewer(
+		const QByteArray &publicKey,
+		const QString &address);
+	void saveLater(
+		const Address &address,
+		const WalletState &stored,
+		const WalletState &state);
+	void flushSave(const Address &address);
 
 	const not_null<Wallet*> _owner;
 	const not_null<RequestSender*> _lib;
 	const not_null<Storage::Cache::Database*> _db;
 
-	base::flat_map<QString, Viewers> _map;
+	base::flat_map<Address, Viewers> _map;
+
+	// Decoded states of recently closed viewers, the most recent last.
+	std::vector<ClosedState> _closed;
+
+	// Loaded by preloadStates() and not yet taken by any viewers.
+	base::flat_map<Address, WalletState> _preloaded;
 
 	base::Timer _refreshTimer;
 
+	base::flat_map<Address, UnsavedState> _unsaved;
+	base::Timer _saveTimer;
+
 	rpl::event_stream<BlockchainTime> _blockchainTime;
 
+	rpl::lifetime _lifetime;
+
 };
 
 } // namespace Ton::details
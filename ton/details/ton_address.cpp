@@ -0,0 +1,192 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ton/details/ton_address.h"
+
+namespace Ton::details {
+namespace {
+
+constexpr auto kPackedSize = 36;
+constexpr auto kEncodedSize = 48;
+constexpr auto kHashSize = 32;
+constexpr auto kMaxRawSize = 11 + 1 + 2 * kHashSize;
+constexpr auto kBounceableFlag = uchar(0x11);
+constexpr auto kNonBounceableFlag = uchar(0x51);
+constexpr auto kTestnetFlag = uchar(0x80);
+constexpr auto kMinWorkchain = -128;
+constexpr auto kMaxWorkchain = 127;
+constexpr auto kUrlSafeAlphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz"
+	"0123456789-_";
+
+[[nodiscard]] int Base64Value(ushort ch) {
+	if (ch >= 'A' && ch <= 'Z') {
+		return ch - 'A';
+	} else if (ch >= 'a' && ch <= 'z') {
+		return ch - 'a' + 26;
+	} else if (ch >= '0' && ch <= '9') {
+		return ch - '0' + 52;
+	} else if (ch == '+' || ch == '-') {
+		return 62;
+	} else if (ch == '/' || ch == '_') {
+		return 63;
+	}
+	return -1;
+}
+
+[[nodiscard]] int HexValue(ushort ch) {
+	if (ch >= '0' && ch <= '9') {
+		return ch - '0';
+	} else if (ch >= 'a' && ch <= 'f') {
+		return ch - 'a' + 10;
+	} else if (ch >= 'A' && ch <= 'F') {
+		return ch - 'A' + 10;
+	}
+	return -1;
+}
+
+[[nodiscard]] std::optional<AccountAddress> ParsePacked(
+		const QString &address) {
+	auto packed = std::array<uchar, kPackedSize>();
+	const auto chars = address.constData();
+	for (auto i = 0; i != kEncodedSize; i += 4) {
+		auto quad = uint32();
+		for (auto j = 0; j != 4; ++j) {
+			const auto value = Base64Value(chars[i + j].unicode());
+			if (value < 0) {
+				return std::nullopt;
+			}
+			quad = (quad << 6) | uint32(value);
+		}
+		const auto offset = (i / 4) * 3;
+		packed[offset] = uchar(quad >> 16);
+		packed[offset + 1] = uchar(quad >> 8);
+		packed[offset + 2] = uchar(quad);
+	}
+	const auto crc = (uint16(packed[34]) << 8) | uint16(packed[35]);
+	if (AddressCrc16(packed.data(), 34) != crc) {
+		return std::nullopt;
+	}
+	const auto flags = packed[0];
+	const auto tag = uchar(flags & ~kTestnetFlag);
+	if (tag != kBounceableFlag && tag != kNonBounceableFlag) {
+		return std::nullopt;
+	}
+	auto result = AccountAddress();
+	result.raw.workchain = int32(int8(packed[1]));
+	result.bounceable = (tag == kBounceableFlag);
+	result.testnet = (flags & kTestnetFlag) != 0;
+	std::copy(
+		packed.begin() + 2,
+		packed.begin() + 2 + kHashSize,
+		result.raw.hash.begin());
+	return result;
+}
+
+[[nodiscard]] std::optional<AccountAddress> ParseRaw(const QString &address) {
+	const auto chars = address.constData();
+	const auto size = address.size();
+	const auto colon = address.indexOf(':');
+	if (colon < 1 || size - colon - 1 != 2 * kHashSize) {
+		return std::nullopt;
+	}
+	auto ok = false;
+	const auto workchain = address.midRef(0, colon).toInt(&ok);
+	if (!ok || workchain < kMinWorkchain || workchain > kMaxWorkchain) {
+		// The user-friendly form has only one byte for it.
+		return std::nullopt;
+	}
+	auto result = AccountAddress();
+	result.raw.workchain = workchain;
+	for (auto i = 0; i != kHashSize; ++i) {
+		const auto high = HexValue(chars[colon + 1 + 2 * i].unicode());
+		const auto low = HexValue(chars[colon + 2 + 2 * i].unicode());
+		if (high < 0 || low < 0) {
+			return std::nullopt;
+		}
+		result.raw.hash[i] = uchar((high << 4) | low);
+	}
+	return result;
+}
+
+} // namespace
+
+std::optional<AccountAddress> ParseAddress(const QString &address) {
+	const auto size = address.size();
+	if (size == kEncodedSize) {
+		return ParsePacked(address);
+	} else if (size > kEncodedSize && size <= kMaxRawSize) {
+		return ParseRaw(address);
+	}
+	return std::nullopt;
+}
+
+bool SameAddress(const QString &a, const QString &b) {
+	if (a == b) {
+		return true;
+	}
+	const auto parsedA = ParseAddress(a);
+	const auto parsedB = parsedA ? ParseAddress(b) : std::nullopt;
+	return parsedB && (parsedA->raw == parsedB->raw);
+}
+
+QString FormatAddress(const AccountAddress &address) {
+	const auto &raw = address.raw;
+	Expects(raw.workchain >= kMinWorkchain && raw.workchain <= kMaxWorkchain);
+
+	auto packed = std::array<uchar, kPackedSize>();
+	const auto data = packed.data();
+	data[0] = (address.bounceable ? kBounceableFlag : kNonBounceableFlag)
+		| (address.testnet ? kTestnetFlag : uchar(0));
+	data[1] = uchar(int8(raw.workchain));
+	std::copy(raw.hash.begin(), raw.hash.end(), data + 2);
+	const auto crc = AddressCrc16(data, 34);
+	data[34] = uchar(crc >> 8);
+	data[35] = uchar(crc & 0xFF);
+
+	// Encoded right into the result, 36 bytes need no padding.
+	auto result = QString(kEncodedSize, Qt::Uninitialized);
+	auto chars = result.data();
+	for (auto i = 0; i != kPackedSize; i += 3) {
+		const auto triple = (uint32(data[i]) << 16)
+			| (uint32(data[i + 1]) << 8)
+			| uint32(data[i + 2]);
+		for (auto shift = 18; shift >= 0; shift -= 6) {
+			*chars++ = QLatin1Char(kUrlSafeAlphabet[(triple >> shift) & 0x3F]);
+		}
+	}
+	return result;
+}
+
+bool IsFormattedAddress(const QString &address) {
+	// 36 bytes leave no loose bits in base64 and the flags byte takes
+	// only the values we write, so only the alphabet may differ.
+	if (address.size() != kEncodedSize) {
+		return false;
+	}
+	for (const auto ch : address) {
+		if (ch == '+' || ch == '/') {
+			return false;
+		}
+	}
+	return true;
+}
+
+uint16 AddressCrc16(const uchar *data, int size) {
+	// CRC-16/XMODEM, polynomial 0x1021, zero initial value.
+	auto result = uint16(0);
+	for (auto i = 0; i != size; ++i) {
+		result ^= uint16(data[i]) << 8;
+		for (auto bit = 0; bit != 8; ++bit) {
+			result = (result & 0x8000)
+				? uint16((result << 1) ^ 0x1021)
+				: uint16(result << 1);
+		}
+	}
+	return result;
+}
+
+} // namespace Ton::details
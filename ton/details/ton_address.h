@@ -0,0 +1,40 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "ton/ton_state.h"
+
+#include <optional>
+
+namespace Ton::details {
+
+struct AccountAddress {
+	Address raw;
+	bool bounceable = true;
+	bool testnet = false;
+};
+
+// Accepts the user-friendly form, both in standard and url-safe base64,
+// and the raw "workchain:hex" form. Rejects anything with a bad CRC.
+// Runs in time bounded by the length of a valid address.
+[[nodiscard]] std::optional<AccountAddress> ParseAddress(
+	const QString &address);
+
+// Different forms of one account are the same address,
+// strings that don't parse are compared as they are.
+[[nodiscard]] bool SameAddress(const QString &a, const QString &b);
+
+// Formats in the user-friendly url-safe form.
+[[nodiscard]] QString FormatAddress(const AccountAddress &address);
+
+// For a string that was parsed, tells whether FormatAddress() gives it
+// back exactly, checking the characters without formatting anything.
+[[nodiscard]] bool IsFormattedAddress(const QString &address);
+
+[[nodiscard]] uint16 AddressCrc16(const uchar *data, int size);
+
+} // namespace Ton::details
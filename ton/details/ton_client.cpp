@@ -6,71 +6,413 @@
 //
 #include "ton/details/ton_client.h"
 
+#include <QtCore/QWaitCondition>
+#include <deque>
+
 namespace Ton::details {
 namespace {
 
-constexpr auto kMinRequestResendDelay = crl::time(100);
-constexpr auto kMaxRequestResendDelay = 10 * crl::time(1000);
+constexpr auto kReceiveTimeout = 1.;
+constexpr auto kExpiredCheckPeriod = crl::time(1000);
+constexpr auto kTimeoutErrorCode = 408;
+
+} // namespace
+
+class Client::Dispatcher final {
+public:
+	Dispatcher();
+	~Dispatcher();
+
+	void push(FnMut<void()> task);
+
+private:
+	void run();
 
-crl::time NextRequestResendDelay(crl::time currentDelay) {
-	return !currentDelay
-		? kMinRequestResendDelay
-		: std::clamp(
-			currentDelay * 2,
-			crl::time(1000),
-			kMaxRequestResendDelay);
+	QMutex _mutex;
+	QWaitCondition _wakeup;
+	std::deque<FnMut<void()>> _tasks;
+	bool _finished = false;
+	std::thread _thread;
+
+};
+
+Client::Dispatcher::Dispatcher() : _thread([=] { run(); }) {
 }
 
-} // namespace
+Client::Dispatcher::~Dispatcher() {
+	QMutexLocker lock(&_mutex);
+	_finished = true;
+	auto skipped = base::take(_tasks);
+	_wakeup.wakeAll();
+	lock.unlock();
+
+	_thread.join();
+}
+
+void Client::Dispatcher::push(FnMut<void()> task) {
+	QMutexLocker lock(&_mutex);
+	_tasks.push_back(std::move(task));
+	_wakeup.wakeOne();
+}
+
+void Client::Dispatcher::run() {
+	QMutexLocker lock(&_mutex);
+	while (true) {
+		while (!_finished && _tasks.empty()) {
+			_wakeup.wait(&_mutex);
+		}
+		if (_finished) {
+			return;
+		}
+		auto task = std::move(_tasks.front());
+		_tasks.pop_front();
+		lock.unlock();
 
-Client::Client(Fn<void(LibUpdate)> updateCallback)
+		task();
+		task = nullptr;
+
+		lock.relock();
+	}
+}
+
+Client::Client(
+	Fn<void(LibUpdate)> updateCallback,
+	const ClientSettings &settings)
 : _updateCallback(std::move(updateCallback))
+, _resends([=](RequestId requestId) { resend(requestId); })
+, _dispatchers([&] {
+	auto result = std::vector<std::unique_ptr<Dispatcher>>();
+	const auto count = std::max(settings.dispatchThreads, 1);
+	result.reserve(count);
+	for (auto i = 0; i != count; ++i) {
+		result.push_back(std::make_unique<Dispatcher>());
+	}
+	return result;
+}())
 , _thread([=] { check(); }) {
+	lane(RequestPriority::Interactive).limit = settings.interactiveLimit;
+	lane(RequestPriority::Normal).limit = settings.normalLimit;
+	lane(RequestPriority::Background).limit = settings.backgroundLimit;
+	_windowLimit = settings.inFlightLimit;
+	_queueLimit = settings.queueLimit;
 }
 
 Client::~Client() {
 	_finished = true;
-	QMutexLocker lock(&_mutex);
-	_handlers.clear();
-	lock.unlock();
-	send(
-		[] { return tonlib_api::make_object<tonlib_api::close>(); },
-		nullptr);
+
+	// Queued retries must not reach the closed tonlib client.
+	_resends.stop();
+	for (auto &shard : _shards) {
+		QMutexLocker lock(&shard.mutex);
+		auto records = base::take(shard.records);
+		lock.unlock();
+	}
+	_wrapped.send({
+		++_requestIdAutoIncrement,
+		tonlib_api::make_object<tonlib_api::close>()
+	});
 	_thread.join();
+
+	// Stop handlers before the state they use is destroyed.
+	_dispatchers.clear();
 }
 
-RequestId Client::send(
-		Fn<LibRequest()> request,
-		FnMut<bool(LibResponse)> handler) {
-	const auto requestId = (_requestIdAutoIncrement++) + 1;
-	const auto libRequestId = (_libRequestIdAutoIncrement++) + 1;
-	auto sending = request();
+RequestId Client::reserveRequestId() {
+	return ++_requestIdAutoIncrement;
+}
 
-	QMutexLocker lock(&_mutex);
-	_requestIdByLibRequestId.emplace(libRequestId, requestId);
-	_requests.emplace(requestId, std::move(request));
-	if (handler) {
-		_handlers.emplace(requestId, std::move(handler));
+Client::LibResponse Client::MakeTimeoutError() {
+	return tonlib_api::make_object<tonlib_api::error>(
+		kTimeoutErrorCode,
+		"TIMEOUT");
+}
+
+bool Client::Record::abandoned() const {
+	return (guard && !*guard) || (owner && !*owner);
+}
+
+Client::Record Client::MakeRecord(Query &&query) {
+	auto result = Record();
+	result.request = std::move(query.request);
+	result.handler = std::move(query.handler);
+	result.deadline = query.timeout ? (crl::now() + query.timeout) : 0;
+	result.guard = std::move(query.guard);
+	result.owner = std::move(query.owner);
+	result.priority = query.priority;
+	result.ordered = query.ordered;
+	return result;
+}
+
+Client::Record Client::Detach(Record &record) {
+	auto result = std::move(record);
+	record = Record();
+	if (result.sent) {
+		record.priority = result.priority;
+		record.started = record.sent = record.dropped = true;
+	}
+	return result;
+}
+
+Client::Shard &Client::shard(RequestId requestId) {
+	return _shards[requestId % kShardsCount];
+}
+
+Client::Lane &Client::lane(RequestPriority priority) {
+	return _lanes[static_cast<int>(priority)];
+}
+
+bool Client::canStart(RequestPriority priority) {
+	// Interactive requests are not limited by the shared window.
+	const auto &lane = this->lane(priority);
+	return (!lane.limit || lane.running < lane.limit)
+		&& (!_windowLimit
+			|| _running < _windowLimit
+			|| priority == RequestPriority::Interactive);
+}
+
+void Client::occupy(RequestPriority priority) {
+	++lane(priority).running;
+	++_running;
+}
+
+void Client::vacate(RequestPriority priority) {
+	--lane(priority).running;
+	--_running;
+}
+
+bool Client::acquire(RequestPriority priority, RequestId requestId) {
+	QMutexLocker lock(&_queueMutex);
+	if (canStart(priority)) {
+		occupy(priority);
+		return true;
+	}
+	lane(priority).queued.push_back(requestId);
+	++_queued;
+	checkQueueFull();
+	return false;
+}
+
+void Client::dequeue(RequestPriority priority, RequestId requestId) {
+	QMutexLocker lock(&_queueMutex);
+	auto &queued = lane(priority).queued;
+	const auto i = ranges::find(queued, requestId);
+	if (i != end(queued)) {
+		queued.erase(i);
+		--_queued;
+		checkQueueFull();
+	}
+}
+
+void Client::checkQueueFull() {
+	const auto full = _queueLimit
+		&& (_queueFull
+			? (_queued > _queueLimit / 2)
+			: (_queued >= _queueLimit));
+	if (_queueFull != full) {
+		_queueFull = full;
+		crl::on_main(this, [=] {
+			_queueFullChanges = full;
+		});
+	}
+}
+
+bool Client::start(RequestId requestId) {
+	auto &shard = this->shard(requestId);
+	QMutexLocker lock(&shard.mutex);
+	const auto i = shard.records.find(requestId);
+	if (i == end(shard.records)) {
+		return false;
+	}
+	auto sending = i->second.request();
+	const auto functionId = sending->get_id();
+	i->second.started = i->second.sent = true;
+	i->second.functionId = functionId;
+	i->second.startedAt = RequestMetrics::Now();
+	lock.unlock();
+
+	_metrics.started(*sending);
+	_wrapped.send({ requestId, std::move(sending) });
+	return true;
+}
+
+void Client::start(
+		std::vector<std::pair<RequestId, RequestPriority>> &&list) {
+	// Group by shards to lock each of them only once.
+	ranges::sort(list, ranges::less(), [](const auto &pair) {
+		return pair.first % kShardsCount;
+	});
+	auto sending = std::vector<std::pair<RequestId, LibRequest>>();
+	auto vacated = std::vector<RequestPriority>();
+	sending.reserve(list.size());
+	const auto startedAt = RequestMetrics::Now();
+	for (auto from = begin(list); from != end(list);) {
+		auto &shard = this->shard(from->first);
+		QMutexLocker lock(&shard.mutex);
+		const auto till = std::find_if(from, end(list), [&](const auto &pair) {
+			return (&this->shard(pair.first) != &shard);
+		});
+		for (; from != till; ++from) {
+			const auto [requestId, priority] = *from;
+			const auto i = shard.records.find(requestId);
+			if (i == end(shard.records)) {
+				vacated.push_back(priority);
+				continue;
+			}
+			auto request = i->second.request();
+			i->second.started = i->second.sent = true;
+			i->second.functionId = request->get_id();
+			i->second.startedAt = startedAt;
+			sending.emplace_back(requestId, std::move(request));
+		}
+	}
+	for (auto &[requestId, request] : sending) {
+		_metrics.started(*request);
+		_wrapped.send({ requestId, std::move(request) });
+	}
+	if (!vacated.empty()) {
+		QMutexLocker lock(&_queueMutex);
+		for (const auto priority : vacated) {
+			vacate(priority);
+		}
+		lock.unlock();
+
+		pump();
+	}
+}
+
+void Client::enqueue(RequestPriority priority, RequestId requestId) {
+	if (acquire(priority, requestId) && !start(requestId)) {
+		release(priority);
+	}
+}
+
+void Client::release(RequestPriority priority) {
+	QMutexLocker lock(&_queueMutex);
+	vacate(priority);
+	lock.unlock();
+
+	pump();
+}
+
+void Client::pump() {
+	constexpr auto kPriorities = {
+		RequestPriority::Interactive,
+		RequestPriority::Normal,
+		RequestPriority::Background,
+	};
+	while (true) {
+		QMutexLocker lock(&_queueMutex);
+		auto next = std::optional<std::pair<RequestPriority, RequestId>>();
+		for (const auto priority : kPriorities) {
+			auto &queued = lane(priority).queued;
+			if (!queued.empty() && canStart(priority)) {
+				next.emplace(priority, queued.front());
+				queued.pop_front();
+				--_queued;
+				occupy(priority);
+				checkQueueFull();
+				break;
+			}
+		}
+		lock.unlock();
+
+		if (!next) {
+			return;
+		} else if (!start(next->second)) {
+			// Cancelled or expired while waiting in the queue.
+			lock.relock();
+			vacate(next->first);
+		}
+	}
+}
+
+void Client::finish(const Record &record, RequestId requestId) {
+	if (record.sent) {
+		// The stub left in the shard does that when tonlib answers.
+		return;
+	} else if (record.started) {
+		_metrics.finished();
+		release(record.priority);
+	} else {
+		dequeue(record.priority, requestId);
 	}
+}
+
+RequestId Client::send(Query &&query) {
+	const auto requestId = (_requestIdAutoIncrement++) + 1;
+	const auto priority = query.priority;
+
+	auto &shard = this->shard(requestId);
+	QMutexLocker lock(&shard.mutex);
+	shard.records.emplace(requestId, MakeRecord(std::move(query)));
 	lock.unlock();
 
-	_wrapped.send({ libRequestId, std::move(sending) });
+	enqueue(priority, requestId);
 	return requestId;
 }
 
-void Client::resend(RequestId requestId) {
-	const auto libRequestId = (_libRequestIdAutoIncrement++) + 1;
+std::vector<RequestId> Client::send(std::vector<Query> &&queries) {
+	const auto count = int(queries.size());
+	const auto first = _requestIdAutoIncrement.fetch_add(count) + 1;
+	auto priorities = std::vector<RequestPriority>();
+	priorities.reserve(count);
+	for (const auto &query : queries) {
+		priorities.push_back(query.priority);
+	}
 
-	QMutexLocker lock(&_mutex);
-	const auto i = _requests.find(requestId);
-	if (i == end(_requests)) {
+	// Consecutive ids go to all shards in turn, lock each one only once.
+	for (auto index = 0; index != std::min(count, kShardsCount); ++index) {
+		auto &shard = this->shard(first + index);
+		QMutexLocker lock(&shard.mutex);
+		for (auto i = index; i < count; i += kShardsCount) {
+			shard.records.emplace(
+				first + i,
+				MakeRecord(std::move(queries[i])));
+		}
+	}
+
+	// Take the free slots for the whole batch at once.
+	auto starting = std::vector<std::pair<RequestId, RequestPriority>>();
+	auto result = std::vector<RequestId>();
+	starting.reserve(count);
+	result.reserve(count);
+	QMutexLocker lock(&_queueMutex);
+	for (auto i = 0; i != count; ++i) {
+		const auto priority = priorities[i];
+		if (canStart(priority)) {
+			occupy(priority);
+			starting.emplace_back(first + i, priority);
+		} else {
+			lane(priority).queued.push_back(first + i);
+			++_queued;
+		}
+		result.push_back(first + i);
+	}
+	checkQueueFull();
+	lock.unlock();
+
+	start(std::move(starting));
+	return result;
+}
+
+void Client::resend(RequestId requestId) {
+	auto &shard = this->shard(requestId);
+	QMutexLocker lock(&shard.mutex);
+	const auto i = shard.records.find(requestId);
+	if (i == end(shard.records)) {
+		return;
+	} else if (i->second.abandoned()) {
+		auto record = std::move(i->second);
+		shard.records.erase(i);
+		lock.unlock();
+		finish(record, requestId);
 		return;
 	}
-	auto request = i->second;
-	_requestIdByLibRequestId.emplace(libRequestId, requestId);
+	auto request = i->second.request;
+	i->second.sent = true;
 	lock.unlock();
 
-	_wrapped.send({ libRequestId, request() });
+	_wrapped.send({ requestId, request() });
 }
 
 Client::LibResponse Client::Execute(LibRequest request) {
@@ -78,58 +420,208 @@ Client::LibResponse Client::Execute(LibRequest request) {
 }
 
 void Client::cancel(RequestId requestId) {
-	QMutexLocker lock(&_mutex);
-	_requests.remove(requestId);
-	_handlers.remove(requestId);
+	auto &shard = this->shard(requestId);
+	QMutexLocker lock(&shard.mutex);
+	const auto i = shard.records.find(requestId);
+	if (i == end(shard.records) || i->second.dropped) {
+		return;
+	} else if (i->second.handling) {
+		i->second.dropped = true;
+		return;
+	}
+	auto record = Detach(i->second);
+	if (!record.sent) {
+		shard.records.erase(i);
+	}
+	lock.unlock();
+
+	finish(record, requestId);
 }
 
-rpl::producer<RequestId> Client::resendingOnError() const {
-	return _resendingOnError.events();
+rpl::producer<RequestId> Client::resendingOnError(
+		const base::has_weak_ptr *owner) const {
+	return _resendingOnError.events(
+	) | rpl::filter([=](const Resending &resending) {
+		return (resending.owner == owner);
+	}) | rpl::map([](const Resending &resending) {
+		return resending.requestId;
+	});
 }
 
-void Client::scheduleResendOnError(RequestId requestId) {
-	crl::on_main(this, [=] {
-		const auto delay = _requestResendDelays.take(requestId).value_or(0);
-		const auto nextDelay = NextRequestResendDelay(delay);
-		_resendingOnError.fire_copy(requestId);
-		_requestResendDelays.emplace(requestId, nextDelay);
-		_resendTimer.call(nextDelay, [=] {
-			resend(requestId);
-		});
+not_null<RequestMetrics*> Client::metrics() {
+	return &_metrics;
+}
+
+RequestMetricsSnapshot Client::metricsSnapshot() const {
+	auto result = _metrics.snapshot();
+	QMutexLocker lock(&_queueMutex);
+	result.queued = _queued;
+	return result;
+}
+
+rpl::producer<bool> Client::queueFull() const {
+	return _queueFullChanges.value();
+}
+
+void Client::dispatch(bool ordered, FnMut<void()> task) {
+	// The first dispatcher is serial for ordered requests and updates,
+	// the rest of the handlers are spread across all of them.
+	const auto index = ordered
+		? 0
+		: (_dispatchAutoIncrement++ % _dispatchers.size());
+	_dispatchers[index]->push(std::move(task));
+}
+
+void Client::dispatch(
+		RequestId requestId,
+		Record record,
+		LibResponse response) {
+	const auto ordered = record.ordered;
+	dispatch(ordered, [
+		=,
+		record = std::move(record),
+		response = std::move(response)
+	]() mutable {
+		handle(requestId, std::move(record), std::move(response));
 	});
 }
 
-void Client::check() {
-	while (!_finished) {
-		auto response = _wrapped.receive(60.);
-		if (!response.object) {
-			continue;
+void Client::handle(
+		RequestId requestId,
+		Record record,
+		LibResponse response) {
+	const auto received = RequestMetrics::Now();
+	const auto handled = record.handler(std::move(response));
+	_metrics.handled(record.functionId, RequestMetrics::Now() - received);
+
+	auto &shard = this->shard(requestId);
+	QMutexLocker lock(&shard.mutex);
+	// Records are cleared when the client is destroyed.
+	const auto i = shard.records.find(requestId);
+	const auto cancelled = (i == end(shard.records)) || i->second.dropped;
+	if (handled || cancelled) {
+		if (i != end(shard.records)) {
+			shard.records.erase(i);
 		}
-		QMutexLocker lock(&_mutex);
-		const auto requestId = _requestIdByLibRequestId.take(response.id);
-		auto handler = requestId ? _handlers.take(*requestId) : std::nullopt;
 		lock.unlock();
 
-		if (handler) {
-			if ((*handler)(std::move(response.object))) {
-				QMutexLocker lock(&_mutex);
-				_requests.remove(*requestId);
+		if (handled) {
+			_metrics.responded(
+				record.functionId,
+				received - record.startedAt);
+			_resends.succeeded();
+		}
+		finish(record, requestId);
+		return;
+	}
+	_metrics.resent(record.functionId);
+	const auto attempt = record.failures++;
+	const auto owned = record.owner.has_value();
+	const auto owner = owned ? record.owner->get() : nullptr;
+	i->second = std::move(record);
+	lock.unlock();
+
+	_resends.failed(requestId, attempt);
+	if (owned && !owner) {
+		return;
+	}
+	crl::on_main(this, [=] {
+		_resendingOnError.fire({ requestId, owner });
+	});
+}
+
+void Client::expire(RequestId requestId, Record record) {
+	const auto ordered = record.ordered;
+	_metrics.timedOut(record.functionId);
+	dispatch(ordered, [=, record = std::move(record)]() mutable {
+		record.handler(MakeTimeoutError());
+		finish(record, requestId);
+	});
+}
+
+void Client::checkExpired() {
+	const auto now = crl::now();
+	if (now < _nextExpiredCheck) {
+		return;
+	}
+	_nextExpiredCheck = now + kExpiredCheckPeriod;
+	for (auto &shard : _shards) {
+		auto abandoned = std::vector<std::pair<RequestId, Record>>();
+		auto timedOut = std::vector<std::pair<RequestId, Record>>();
+		QMutexLocker lock(&shard.mutex);
+		for (auto i = begin(shard.records); i != end(shard.records);) {
+			auto &record = i->second;
+			if (record.abandoned()) {
+				abandoned.emplace_back(i->first, Detach(record));
+			} else if (record.deadline && record.deadline <= now) {
+				timedOut.emplace_back(i->first, Detach(record));
+			} else {
+				++i;
+				continue;
+			}
+			if (record.dropped) {
+				++i;
 			} else {
-				QMutexLocker lock(&_mutex);
-				_handlers.emplace(*requestId, std::move(*handler));
-				lock.unlock();
+				i = shard.records.erase(i);
+			}
+		}
+		lock.unlock();
 
-				scheduleResendOnError(*requestId);
+		for (const auto &[requestId, record] : abandoned) {
+			finish(record, requestId);
+		}
+		for (auto &[requestId, record] : timedOut) {
+			if (record.handler) {
+				expire(requestId, std::move(record));
+			} else {
+				finish(record, requestId);
 			}
-		} else {
-			if (requestId) {
-				QMutexLocker lock(&_mutex);
-				_requests.remove(*requestId);
-			} else if (!response.id && _updateCallback) {
-				_updateCallback(tonlib_api::move_object_as<tonlib_api::Update>(
-					std::move(response.object)));
+		}
+	}
+}
+
+void Client::check() {
+	while (!_finished) {
+		auto response = _wrapped.receive(kReceiveTimeout);
+		checkExpired();
+		if (!response.object) {
+			continue;
+		} else if (!response.id) {
+			if (_updateCallback) {
+				dispatch(true, [
+					=,
+					update = tonlib_api::move_object_as<tonlib_api::Update>(
+						std::move(response.object))
+				]() mutable {
+					_updateCallback(std::move(update));
+				});
 			}
+			continue;
 		}
+		const auto requestId = RequestId(response.id);
+		auto &shard = this->shard(requestId);
+		QMutexLocker lock(&shard.mutex);
+		const auto i = shard.records.find(requestId);
+		if (i == end(shard.records)) {
+			continue;
+		}
+		auto record = std::move(i->second);
+		record.sent = false;
+		if (!record.handler || record.abandoned()) {
+			shard.records.erase(i);
+			lock.unlock();
+
+			finish(record, requestId);
+			continue;
+		}
+
+		// Holds the slot and lets cancel() mark it until handled.
+		i->second = Record();
+		i->second.priority = record.priority;
+		i->second.started = i->second.handling = true;
+		lock.unlock();
+
+		dispatch(requestId, std::move(record), std::move(response.object));
 	}
 }
 
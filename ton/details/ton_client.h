@@ -6,7 +6,8 @@
 //
 #pragma once
 
-#include "base/timer.h"
+#include "ton/details/ton_resend_scheduler.h"
+#include "ton/details/ton_request_metrics.h"
 #include "base/weak_ptr.h"
 
 #include <QtCore/QMutex>
@@ -14,11 +15,35 @@
 #include <tonlib/Client.h>
 #include <thread>
 #include <atomic>
+#include <unordered_map>
+#include <array>
+#include <optional>
+#include <deque>
 
 namespace Ton::details {
 
 namespace tonlib_api = ::ton::tonlib_api;
-using RequestId = uint32;
+
+enum class RequestPriority {
+	Interactive,
+	Normal,
+	Background,
+};
+
+struct ClientSettings {
+	// Threads that run response handlers, the receive loop only routes.
+	int dispatchThreads = 2;
+
+	// Requests of each priority running in tonlib at once, 0 - no limit.
+	int interactiveLimit = 0;
+	int normalLimit = 16;
+	int backgroundLimit = 4;
+
+	// Requests running at once in all but the interactive priority
+	// and queue size to report as full, 0 - no limit.
+	int inFlightLimit = 32;
+	int queueLimit = 1024;
+};
 
 class Client final : public base::has_weak_ptr {
 public:
@@ -26,40 +51,152 @@ public:
 	using LibResponse = tonlib_api::object_ptr<tonlib_api::Object>;
 	using LibUpdate = tonlib_api::object_ptr<tonlib_api::Update>;
 
-	explicit Client(Fn<void(LibUpdate)> updateCallback);
+	struct Query {
+		Fn<LibRequest()> request;
+		FnMut<bool(LibResponse)> handler;
+		RequestPriority priority = RequestPriority::Normal;
+		bool ordered = false;
+
+		// Fails with a TIMEOUT error if not answered in time,
+		// the time spent waiting for a free slot in the lane counts.
+		crl::time timeout = 0;
+
+		// Dropped without invoking the handler once the guard dies.
+		std::optional<base::weak_ptr<const base::has_weak_ptr>> guard;
+
+		// Same as the guard, set to the sender of a shared client.
+		std::optional<base::weak_ptr<const base::has_weak_ptr>> owner;
+	};
+
+	explicit Client(
+		Fn<void(LibUpdate)> updateCallback,
+		const ClientSettings &settings = ClientSettings());
 	~Client();
 
-	RequestId send(
-		Fn<LibRequest()> request,
-		FnMut<bool(LibResponse)> handler);
+	// Handlers of ordered requests and all updates are invoked
+	// on the same dispatch thread in the order they were received.
+	RequestId send(Query &&query);
+	std::vector<RequestId> send(std::vector<Query> &&queries);
 	void cancel(RequestId requestId);
 
-	[[nodiscard]] rpl::producer<RequestId> resendingOnError() const;
+	// An identifier that is never used for requests sent to tonlib.
+	[[nodiscard]] RequestId reserveRequestId();
+
+	// Only for the requests with this owner, nullptr for unowned ones.
+	[[nodiscard]] rpl::producer<RequestId> resendingOnError(
+		const base::has_weak_ptr *owner) const;
+
+	// Fires true when queued requests reach the queueLimit
+	// and false when the queue shrinks to half of it.
+	[[nodiscard]] rpl::producer<bool> queueFull() const;
+
+	[[nodiscard]] not_null<RequestMetrics*> metrics();
+	[[nodiscard]] RequestMetricsSnapshot metricsSnapshot() const;
 
 	static LibResponse Execute(LibRequest request);
+	[[nodiscard]] static LibResponse MakeTimeoutError();
 
 private:
+	class Dispatcher;
+
+	struct Resending {
+		RequestId requestId = 0;
+		const base::has_weak_ptr *owner = nullptr;
+	};
+
+	// Requests are sent to tonlib with their own RequestId,
+	// so a single record is enough to route a response.
+	struct Record {
+		Fn<LibRequest()> request;
+		FnMut<bool(LibResponse)> handler;
+		crl::time deadline = 0;
+		std::optional<base::weak_ptr<const base::has_weak_ptr>> guard;
+		std::optional<base::weak_ptr<const base::has_weak_ptr>> owner;
+		RequestPriority priority = RequestPriority::Normal;
+		bool ordered = false;
+		bool started = false;
+
+		// Tonlib runs the request right now, so it holds the slot
+		// until the response arrives even if cancelled or expired.
+		bool sent = false;
+
+		// A stub without a handler, only holds the slot, or a record
+		// which handler runs now, marked by cancel() to skip a resend.
+		bool dropped = false;
+		bool handling = false;
+
+		int failures = 0;
+		int32 functionId = 0;
+		int64 startedAt = 0;
+
+		[[nodiscard]] bool abandoned() const;
+	};
+	struct Shard {
+		QMutex mutex;
+		std::unordered_map<RequestId, Record> records;
+	};
+	static constexpr auto kShardsCount = 16;
+
+	// Requests of one priority wait in the queue for a free slot.
+	// Lanes and the counters below are guarded by the _queueMutex.
+	struct Lane {
+		int limit = 0;
+		int running = 0;
+		std::deque<RequestId> queued;
+	};
+	static constexpr auto kLanesCount = 3;
+
+	[[nodiscard]] static Record MakeRecord(Query &&query);
+	[[nodiscard]] static Record Detach(Record &record);
+	[[nodiscard]] Shard &shard(RequestId requestId);
+	[[nodiscard]] Lane &lane(RequestPriority priority);
+	[[nodiscard]] bool canStart(RequestPriority priority);
+	void occupy(RequestPriority priority);
+	void vacate(RequestPriority priority);
+	[[nodiscard]] bool acquire(RequestPriority priority, RequestId requestId);
+	void dequeue(RequestPriority priority, RequestId requestId);
+	void checkQueueFull();
+	[[nodiscard]] bool start(RequestId requestId);
+	void start(std::vector<std::pair<RequestId, RequestPriority>> &&list);
+	void enqueue(RequestPriority priority, RequestId requestId);
+	void release(RequestPriority priority);
+	void pump();
+	void finish(const Record &record, RequestId requestId);
 	void check();
-	void scheduleResendOnError(RequestId requestId);
+	void checkExpired();
+	void dispatch(bool ordered, FnMut<void()> task);
+	void dispatch(RequestId requestId, Record record, LibResponse response);
+	void handle(RequestId requestId, Record record, LibResponse response);
+	void expire(RequestId requestId, Record record);
 	void resend(RequestId requestId);
 
 	tonlib::Client _wrapped;
 	std::atomic<RequestId> _requestIdAutoIncrement = 0;
-	std::atomic<uint32> _libRequestIdAutoIncrement = 0;
 	const Fn<void(LibUpdate)> _updateCallback;
 
-	QMutex _mutex;
-	base::flat_map<uint32, RequestId> _requestIdByLibRequestId;
-	base::flat_map<RequestId, Fn<LibRequest()>> _requests;
-	base::flat_map<RequestId, FnMut<bool(LibResponse)>> _handlers;
+	std::array<Shard, kShardsCount> _shards;
+	mutable QMutex _queueMutex;
+	std::array<Lane, kLanesCount> _lanes;
+	int _windowLimit = 0;
+	int _running = 0;
+	int _queueLimit = 0;
+	int _queued = 0;
+	bool _queueFull = false;
+	RequestMetrics _metrics;
+	ResendScheduler _resends;
+
+	std::vector<std::unique_ptr<Dispatcher>> _dispatchers;
+	std::atomic<uint32> _dispatchAutoIncrement = 0;
 
 	std::thread _thread;
 	std::atomic<bool> _finished = false;
 
+	// Accessed from the receive thread only.
+	crl::time _nextExpiredCheck = 0;
+
 	// Accessed from main thread only.
-	base::flat_map<RequestId, crl::time> _requestResendDelays;
-	base::DelayedCallTimer _resendTimer;
-	rpl::event_stream<RequestId> _resendingOnError;
+	rpl::event_stream<Resending> _resendingOnError;
+	rpl::variable<bool> _queueFullChanges = false;
 
 };
 
@@ -28,6 +28,7 @@ constexpr auto kSaltSize = size_type(32);
 constexpr auto kIterations = 100'000;
 constexpr auto kMaxTonLibLogSize = 50 * 1024 * 1024;
 constexpr auto kErrorsTillSetConfig = 3;
+constexpr auto kSyncStateUpdateDelay = crl::time(16);
 constexpr auto kDebugVerbosity = 10;
 
 std::atomic<bool> LoggingEnabled = false;
@@ -78,26 +79,59 @@ std::atomic<bool> LoggingEnabled = false;
 
 } // namespace
 
-External::External(const QString &path, Fn<void(Update)> &&updateCallback)
+Error SharedClientError() {
+	return Error{ Error::Type::TonLib, "SHARED_CLIENT" };
+}
+
+External::External(
+	const QString &path,
+	Fn<void(Update)> &&updateCallback,
+	std::shared_ptr<SharedClient> shared)
 : _basePath(path.endsWith('/') ? path : (path + '/'))
 , _updateCallback(std::move(updateCallback))
-, _lib(generateUpdateCallback())
+, _syncStateTimer([=] { deliverSyncState(); })
+, _lib(std::move(shared), generateUpdateCallback())
 , _db(MakeDatabase(_basePath)) {
 	Expects(!path.isEmpty());
 }
 
-Fn<void(const TLUpdate &)> External::generateUpdateCallback() const {
+Fn<void(const TLUpdate &)> External::generateUpdateCallback() {
 	if (!_updateCallback) {
 		return nullptr;
 	}
 	const auto weak = base::make_weak(this);
 	return [=](const TLUpdate &update) {
+		if (update.type() == id_updateSyncState) {
+			QMutexLocker lock(&_syncState.mutex);
+			_syncState.latest = update;
+			if (std::exchange(_syncState.scheduled, true)) {
+				return;
+			}
+			lock.unlock();
+			crl::on_main(weak, [=] { deliverSyncState(); });
+			return;
+		}
 		crl::on_main(weak, [=, update = Parse(update)]() mutable {
 			_updateCallback(std::move(update));
 		});
 	};
 }
 
+void External::deliverSyncState() {
+	// While sync states keep coming the timer delivers the latest one
+	// once in a frame, the update handler doesn't post anything.
+	QMutexLocker lock(&_syncState.mutex);
+	auto latest = base::take(_syncState.latest);
+	if (!latest) {
+		_syncState.scheduled = false;
+		return;
+	}
+	lock.unlock();
+
+	_syncStateTimer.callOnce(kSyncStateUpdateDelay);
+	_updateCallback(Parse(*latest));
+}
+
 void External::open(
 		const QByteArray &globalPassword,
 		const Settings &defaultSettings,
@@ -111,41 +145,72 @@ void External::open(
 		return;
 	}
 	_settings = defaultSettings;
+
+	// The library doesn't depend on the database, so it is started
+	// while the key is derived and the database is read. Both stages
+	// are waited for, so a failed open leaves nothing in progress.
+	struct Stages {
+		std::optional<WalletList> wallets;
+		std::optional<Error> error;
+		bool libraryDone = false;
+		bool databaseDone = false;
+		bool databaseOpened = false;
+	};
+	const auto stages = std::make_shared<Stages>();
+	const auto fail = [=](const Error &error) {
+		if (!stages->error) {
+			stages->error = error;
+		}
+	};
+	const auto check = [=] {
+		if (!stages->libraryDone || !stages->databaseDone) {
+			return;
+		} else if (stages->error) {
+			if (stages->databaseOpened) {
+				_db->close();
+			}
+			_state = State::Initial;
+			InvokeCallback(done, *stages->error);
+			return;
+		}
+		_state = State::Opened;
+		if (_configUpgrade != ConfigUpgrade::None) {
+			updateSettings(_settings, nullptr);
+			if (_updateCallback) {
+				_updateCallback({ _configUpgrade });
+			}
+		}
+		InvokeCallback(done, std::move(*base::take(stages->wallets)));
+	};
+	startLibrary([=](Result<> result) {
+		if (!result) {
+			fail(result.error());
+		}
+		stages->libraryDone = true;
+		check();
+	});
 	openDatabase(globalPassword, [=](Result<Settings> result) {
 		if (!result) {
-			_state = State::Initial;
-			InvokeCallback(done, result.error());
+			fail(result.error());
+			stages->databaseDone = true;
+			check();
+			return;
+		}
+		stages->databaseOpened = true;
+		if (stages->error) {
+			stages->databaseDone = true;
+			check();
 			return;
 		}
 		if (!result->test.config.isEmpty()) {
 			applyLocalSettings(*result);
 		}
-		const auto future = std::make_shared<std::optional<WalletList>>();
 		const auto loadedWallets = crl::guard(this, [=](WalletList &&list) {
-			if (_state == State::Opened) {
-				InvokeCallback(done, std::move(list));
-			} else {
-				*future = std::move(list);
-			}
+			stages->wallets = std::move(list);
+			stages->databaseDone = true;
+			check();
 		});
 		LoadWalletList(_db.get(), _settings.useTestNetwork, loadedWallets);
-		startLibrary([=](Result<> result) {
-			if (!result) {
-				_state = State::Initial;
-				InvokeCallback(done, result.error());
-				return;
-			}
-			_state = State::Opened;
-			if (*future) {
-				if (_configUpgrade != ConfigUpgrade::None) {
-					updateSettings(_settings, nullptr);
-					if (_updateCallback) {
-						_updateCallback({ _configUpgrade });
-					}
-				}
-				InvokeCallback(done, std::move(**future));
-			}
-		});
 	});
 }
 
@@ -180,15 +245,22 @@ void External::updateSettings(
 	const auto &was = _settings.net();
 	const auto &now = settings.net();
 	const auto clear = (was.blockchainName != now.blockchainName);
+	const auto shared = _lib.shared();
+	if (shared
+		&& (clear
+			|| was.config != now.config
+			|| _settings.useNetworkCallbacks != settings.useNetworkCallbacks)) {
+		// Other wallets on the same client use this config.
+		InvokeCallback(done, SharedClientError());
+		return;
+	}
 	_settings = settings;
-	const auto config = now.config;
-	_lib.request(TLoptions_SetConfig(
-		tl_config(
-			tl_string(now.config),
-			tl_string(now.blockchainName),
-			tl_from(_settings.useNetworkCallbacks),
-			tl_from(clear))
-	)).done([=](const TLoptions_ConfigInfo &result) {
+	const auto config = tl_config(
+		tl_string(now.config),
+		tl_string(now.blockchainName),
+		tl_from(_settings.useNetworkCallbacks),
+		tl_from(clear));
+	const auto configured = [=](const TLoptions_ConfigInfo &result) {
 		const auto parsed = Parse(result);
 		const auto saved = [=](Result<> result) {
 			if (!result) {
@@ -198,12 +270,33 @@ void External::updateSettings(
 			InvokeCallback(done, parsed);
 		};
 		SaveSettings(_db.get(), settings, crl::guard(this, saved));
-	}).fail([=](const TLError &error) {
+	};
+	if (shared && !shared->ownsConfig(&_lib)) {
+		// The config is the same, only its owner sends it again.
+		shared->configure(&_lib, config, crl::guard(this, [=](
+				Result<TLoptions_ConfigInfo> result) {
+			if (!result) {
+				InvokeCallback(done, result.error());
+				return;
+			}
+			configured(*result);
+		}));
+		return;
+	}
+	_lib.request(TLoptions_SetConfig(
+		config
+	)).done(
+		configured
+	).fail([=](const TLError &error) {
 		InvokeCallback(done, ErrorFromLib(error));
 	}).send();
 }
 
 void External::switchNetwork(Callback<ConfigInfo> done) {
+	if (_lib.shared()) {
+		InvokeCallback(done, SharedClientError());
+		return;
+	}
 	_settings.useTestNetwork = !_settings.useTestNetwork;
 
 	updateSettings(_settings, [=](Result<ConfigInfo> result) {
@@ -219,6 +312,11 @@ void External::switchNetwork(Callback<ConfigInfo> done) {
 void External::resetNetwork() {
 	Expects(_state == State::Opened);
 
+	if (const auto shared = _lib.shared()) {
+		if (!shared->ownsConfig(&_lib)) {
+			return;
+		}
+	}
 	updateSettings(_settings, nullptr);
 }
 
@@ -322,8 +420,7 @@ void External::openDatabase(
 	Expects(_salt.size() == kSaltSize);
 
 	const auto weak = base::make_weak(this);
-	auto key = DatabaseKey(bytes::make_span(globalPassword), _salt);
-	_db->open(std::move(key), [=](Storage::Cache::Error error) {
+	const auto opened = [=](Storage::Cache::Error error) {
 		crl::on_main(weak, [=] {
 			if (const auto bad = ErrorFromStorage(error)) {
 				InvokeCallback(done, *bad);
@@ -334,10 +431,27 @@ void External::openDatabase(
 				LoadSettings(_db.get(), crl::guard(weak, loaded));
 			}
 		});
+	};
+
+	// Key derivation takes a noticeable time with many iterations.
+	crl::async([=, salt = _salt] {
+		auto key = DatabaseKey(bytes::make_span(globalPassword), salt);
+		crl::on_main(weak, [=, key = std::move(key)]() mutable {
+			_db->open(std::move(key), opened);
+		});
 	});
 }
 
 void External::startLibrary(Callback<> done) {
+	if (const auto shared = _lib.shared()) {
+		shared->init(crl::guard(this, done));
+		return;
+	} else if (_libraryStarted) {
+		// Tonlib can't be inited twice, for example after a wrong
+		// password the open is retried with the library running.
+		InvokeCallback(done);
+		return;
+	}
 	const auto path = LibraryStoragePath(_basePath);
 	if (!QDir().mkpath(path)) {
 		InvokeCallback(done, Error{ Error::Type::IO, path });
@@ -349,21 +463,21 @@ void External::startLibrary(Callback<> done) {
 			nullptr,
 			tl_keyStoreTypeDirectory(tl_string(path)))
 	)).done([=] {
+		_libraryStarted = true;
 		InvokeCallback(done);
 	}).fail([=](const TLError &error) {
-		_db->close();
 		InvokeCallback(done, ErrorFromLib(error));
 	}).send();
 }
 
 void External::start(Callback<ConfigInfo> done) {
-	_lib.request(TLoptions_SetConfig(
-		tl_config(
-			tl_string(_settings.net().config),
-			tl_string(_settings.net().blockchainName),
-			tl_from(_settings.useNetworkCallbacks),
-			tl_from(false))
-	)).done([=](const TLoptions_ConfigInfo &result) {
+	const auto config = tl_config(
+		tl_string(_settings.net().config),
+		tl_string(_settings.net().blockchainName),
+		tl_from(_settings.useNetworkCallbacks),
+		tl_from(false));
+	const auto started = [=](const TLoptions_ConfigInfo &result) {
+		// Counts only our own requests, see resetNetwork().
 		_lib.resendingOnError(
 		) | rpl::start_with_next([=] {
 			if (++_failedRequestsSinceSetConfig >= kErrorsTillSetConfig) {
@@ -373,7 +487,24 @@ void External::start(Callback<ConfigInfo> done) {
 		}, _lifetime);
 
 		InvokeCallback(done, Parse(result));
-	}).fail([=](const TLError &error) {
+	};
+	if (const auto shared = _lib.shared()) {
+		// The first wallet on the client sets the config for all.
+		shared->configure(&_lib, config, crl::guard(this, [=](
+				Result<TLoptions_ConfigInfo> result) {
+			if (!result) {
+				InvokeCallback(done, result.error());
+				return;
+			}
+			started(*result);
+		}));
+		return;
+	}
+	_lib.request(TLoptions_SetConfig(
+		config
+	)).done(
+		started
+	).fail([=](const TLError &error) {
 		InvokeCallback(done, ErrorFromLib(error));
 	}).send();
 }
@@ -12,6 +12,9 @@
 #include "storage/storage_databases.h"
 #include "base/bytes.h"
 #include "base/weak_ptr.h"
+#include "base/timer.h"
+
+#include <QtCore/QMutex>
 
 namespace Storage::Cache {
 class Database;
@@ -25,11 +28,19 @@ struct ConfigInfo;
 namespace Ton::details {
 
 class RequestSender;
+class SharedClient;
 struct WalletList;
 
+// Operations that change the keystore or the config of all the wallets
+// on a shared client are rejected with it.
+[[nodiscard]] Error SharedClientError();
+
 class External final : public base::has_weak_ptr {
 public:
-	External(const QString &path, Fn<void(Update)> &&updateCallback);
+	External(
+		const QString &path,
+		Fn<void(Update)> &&updateCallback,
+		std::shared_ptr<SharedClient> shared = nullptr);
 
 	void open(
 		const QByteArray &globalPassword,
@@ -54,9 +65,17 @@ private:
 		Opened,
 	};
 
+	// Only the latest sync state is kept until main thread takes it.
+	struct SyncStateSlot {
+		QMutex mutex;
+		std::optional<TLUpdate> latest;
+		bool scheduled = false;
+	};
+
 	[[nodiscard]] Result<> loadSalt();
 	[[nodiscard]] Result<> writeNewSalt();
-	[[nodiscard]] Fn<void(const TLUpdate &)> generateUpdateCallback() const;
+	[[nodiscard]] Fn<void(const TLUpdate &)> generateUpdateCallback();
+	void deliverSyncState();
 	void openDatabase(
 		const QByteArray &globalPassword,
 		Callback<Settings> done);
@@ -67,12 +86,18 @@ private:
 	const QString _basePath;
 	const Fn<void(Update)> _updateCallback;
 	Settings _settings;
+
+	// Used by the update callback, so it must outlive the _lib.
+	SyncStateSlot _syncState;
+	base::Timer _syncStateTimer;
+
 	RequestSender _lib;
 	Storage::DatabasePointer _db;
 	ConfigUpgrade _configUpgrade = ConfigUpgrade::None;
 
 	State _state = State::Initial;
 	bytes::vector _salt;
+	bool _libraryStarted = false;
 
 	int _failedRequestsSinceSetConfig = 0;
 	rpl::lifetime _lifetime;
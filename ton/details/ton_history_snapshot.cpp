@@ -0,0 +1,184 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ton/details/ton_history_snapshot.h"
+
+#include "ton/ton_history_snapshot.h"
+#include "ton/ton_state.h"
+#include "ton/details/ton_address.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QtEndian>
+
+namespace Ton::details {
+namespace {
+
+[[nodiscard]] int64 Aligned(int64 offset) {
+	return (offset + 7) & ~int64(7);
+}
+
+[[nodiscard]] const QString &Counterparty(const Transaction &data) {
+	return (!data.incoming.source.isEmpty() || data.outgoing.empty())
+		? data.incoming.source
+		: data.outgoing.front().destination;
+}
+
+[[nodiscard]] int64 Value(const Transaction &data) {
+	auto result = data.incoming.value;
+	for (const auto &message : data.outgoing) {
+		result -= message.value;
+	}
+	return result;
+}
+
+class SnapshotWriter final {
+public:
+	explicit SnapshotWriter(const std::vector<Transaction> &list);
+
+	[[nodiscard]] QByteArray finish();
+
+private:
+	[[nodiscard]] int32 counterpartyIndex(const Transaction &data);
+
+	template <typename Number>
+	void putColumn(int64 offset, Number(*value)(const Transaction&));
+
+	void putAddresses(int64 offset);
+
+	template <typename Number>
+	void put(int64 offset, Number value);
+
+	const std::vector<Transaction> &_list;
+	base::flat_map<Address, int32> _indices;
+	std::vector<Address> _counterparties;
+	std::vector<int32> _counterpartyByTransaction;
+	HistorySnapshotHeader _header;
+	QByteArray _result;
+
+};
+
+SnapshotWriter::SnapshotWriter(const std::vector<Transaction> &list)
+: _list(list) {
+	_counterpartyByTransaction.reserve(list.size());
+	for (const auto &transaction : list) {
+		_counterpartyByTransaction.push_back(counterpartyIndex(transaction));
+	}
+}
+
+int32 SnapshotWriter::counterpartyIndex(const Transaction &data) {
+	const auto parsed = ParseAddress(Counterparty(data));
+	if (!parsed) {
+		return -1;
+	}
+	const auto i = _indices.find(parsed->raw);
+	if (i != end(_indices)) {
+		return i->second;
+	}
+	const auto result = int32(_counterparties.size());
+	_indices.emplace(parsed->raw, result);
+	_counterparties.push_back(parsed->raw);
+	return result;
+}
+
+template <typename Number>
+void SnapshotWriter::put(int64 offset, Number value) {
+	qToLittleEndian(value, _result.data() + offset);
+}
+
+template <typename Number>
+void SnapshotWriter::putColumn(
+		int64 offset,
+		Number(*value)(const Transaction&)) {
+	for (const auto &transaction : _list) {
+		put(offset, value(transaction));
+		offset += int64(sizeof(Number));
+	}
+}
+
+void SnapshotWriter::putAddresses(int64 offset) {
+	for (const auto &address : _counterparties) {
+		put(offset, address.workchain);
+		memcpy(
+			_result.data() + offset + sizeof(int32),
+			address.hash.data(),
+			address.hash.size());
+		offset += int64(sizeof(HistorySnapshotAddress));
+	}
+}
+
+QByteArray SnapshotWriter::finish() {
+	const auto count = int64(_list.size());
+	const auto column = count * int64(sizeof(int64));
+	_header.count = int32(count);
+	_header.counterpartiesCount = int32(_counterparties.size());
+	_header.ltOffset = int64(sizeof(HistorySnapshotHeader));
+	_header.timeOffset = _header.ltOffset + column;
+	_header.valueOffset = _header.timeOffset + column;
+	_header.feeOffset = _header.valueOffset + column;
+	_header.counterpartyOffset = _header.feeOffset + column;
+	_header.counterpartiesOffset = Aligned(
+		_header.counterpartyOffset + count * int64(sizeof(int32)));
+	const auto size = _header.counterpartiesOffset
+		+ (_header.counterpartiesCount
+			* int64(sizeof(HistorySnapshotAddress)));
+
+	_result = QByteArray(int(size), char(0));
+	put(0, _header.magic);
+	put(4, _header.version);
+	put(8, _header.count);
+	put(12, _header.counterpartiesCount);
+	put(16, _header.ltOffset);
+	put(24, _header.timeOffset);
+	put(32, _header.valueOffset);
+	put(40, _header.feeOffset);
+	put(48, _header.counterpartyOffset);
+	put(56, _header.counterpartiesOffset);
+
+	putColumn<int64>(_header.ltOffset, [](const Transaction &data) {
+		return data.id.lt;
+	});
+	putColumn<int64>(_header.timeOffset, [](const Transaction &data) {
+		return data.time;
+	});
+	putColumn<int64>(_header.valueOffset, Value);
+	putColumn<int64>(_header.feeOffset, [](const Transaction &data) {
+		return data.fee;
+	});
+	auto offset = _header.counterpartyOffset;
+	for (const auto index : _counterpartyByTransaction) {
+		put(offset, index);
+		offset += int64(sizeof(int32));
+	}
+	putAddresses(_header.counterpartiesOffset);
+	return std::move(_result);
+}
+
+} // namespace
+
+QByteArray SerializeHistorySnapshot(const std::vector<Transaction> &list) {
+	return SnapshotWriter(list).finish();
+}
+
+Result<> WriteHistorySnapshot(
+		const QString &path,
+		const std::vector<Transaction> &list) {
+	const auto bytes = SerializeHistorySnapshot(list);
+	const auto temp = path + ".new";
+	auto file = QFile(temp);
+	if (!file.open(QIODevice::WriteOnly)
+		|| file.write(bytes) != bytes.size()) {
+		return Error{ Error::Type::IO, temp };
+	}
+	file.close();
+	if (QFile::exists(path) && !QFile::remove(path)) {
+		return Error{ Error::Type::IO, path };
+	} else if (!QFile::rename(temp, path)) {
+		return Error{ Error::Type::IO, path };
+	}
+	return {};
+}
+
+} // namespace Ton::details
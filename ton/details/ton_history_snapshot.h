@@ -0,0 +1,26 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "ton/ton_result.h"
+
+namespace Ton {
+struct Transaction;
+} // namespace Ton
+
+namespace Ton::details {
+
+[[nodiscard]] QByteArray SerializeHistorySnapshot(
+	const std::vector<Transaction> &list);
+
+// Writes next to the path and renames, so that readers never map
+// a partially written file.
+[[nodiscard]] Result<> WriteHistorySnapshot(
+	const QString &path,
+	const std::vector<Transaction> &list);
+
+} // namespace Ton::details
@@ -37,11 +37,21 @@ KeyDestroyer::KeyDestroyer(
 KeyDestroyer::KeyDestroyer(
 		not_null<RequestSender*> lib,
 		not_null<Storage::Cache::Database*> db,
+		const WalletList &existing,
 		bool useTestNetwork,
 		Callback<> done) {
 	const auto removeFromDatabase = crl::guard(this, [=](const auto&) {
 		SaveWalletList(db, {}, useTestNetwork, crl::guard(this, done));
 	});
+	if (lib->shared()) {
+		// The keystore holds keys of the other wallets as well.
+		_left.reserve(existing.entries.size());
+		for (const auto &entry : existing.entries) {
+			_left.emplace_back(entry.publicKey, entry.secret);
+		}
+		deleteNext(lib, removeFromDatabase);
+		return;
+	}
 	lib->request(TLDeleteAllKeys(
 	)).done(
 		removeFromDatabase
@@ -50,4 +60,22 @@ KeyDestroyer::KeyDestroyer(
 	).send();
 }
 
+void KeyDestroyer::deleteNext(
+		not_null<RequestSender*> lib,
+		Fn<void(Result<>)> removeFromDatabase) {
+	if (_left.empty()) {
+		removeFromDatabase(Result<>());
+		return;
+	}
+	const auto entry = std::move(_left.back());
+	_left.pop_back();
+	DeletePublicKey(
+		lib,
+		entry.first,
+		entry.second,
+		crl::guard(this, [=](Result<>) {
+			deleteNext(lib, removeFromDatabase);
+		}));
+}
+
 } // namespace Ton::details
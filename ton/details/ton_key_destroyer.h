@@ -30,9 +30,18 @@ public:
 	KeyDestroyer(
 		not_null<RequestSender*> lib,
 		not_null<Storage::Cache::Database*> db,
+		const WalletList &existing,
 		bool useTestNetwork,
 		Callback<> done);
 
+private:
+	void deleteNext(
+		not_null<RequestSender*> lib,
+		Fn<void(Result<>)> removeFromDatabase);
+
+	// Public keys with secrets, deleted one by one on a shared client.
+	std::vector<std::pair<QByteArray, QByteArray>> _left;
+
 };
 
 } // namespace Ton::details
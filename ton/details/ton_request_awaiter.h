@@ -0,0 +1,159 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "ton/details/ton_request_sender.h"
+
+#include <coroutine>
+
+namespace Ton::details {
+
+// Return type of coroutines that co_await requests. They start right
+// away and nobody waits for them, the frame is freed when they finish.
+struct RequestFlow {
+	struct promise_type {
+		RequestFlow get_return_object() noexcept {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() noexcept {
+		}
+		void unhandled_exception() noexcept {
+			std::terminate();
+		}
+	};
+};
+
+enum class ResumeOn {
+	Main,
+	Handler,
+};
+
+// Resumes the suspended coroutine once or destroys it if dropped.
+class CoroutineResumer final {
+public:
+	explicit CoroutineResumer(std::coroutine_handle<> handle) noexcept
+	: _handle(handle) {
+	}
+	CoroutineResumer(CoroutineResumer &&other) noexcept
+	: _handle(std::exchange(other._handle, nullptr)) {
+	}
+	CoroutineResumer &operator=(CoroutineResumer &&other) = delete;
+	~CoroutineResumer() {
+		if (_handle) {
+			_handle.destroy();
+		}
+	}
+
+	void operator()() {
+		std::exchange(_handle, nullptr).resume();
+	}
+
+private:
+	std::coroutine_handle<> _handle;
+
+};
+
+// co_await request(...) gives Result<Request::ResponseType>.
+//
+// The response is converted on the handler thread and the coroutine is
+// resumed on main, unless ResumeOn::Handler is used. If the request is
+// cancelled, abandoned or the RequestSender is destroyed, the suspended
+// coroutine is destroyed without being resumed.
+template <typename Request>
+class [[nodiscard]] RequestAwaiter final {
+public:
+	using Builder = RequestSender::SpecificRequestBuilder<Request>;
+	using Response = typename Request::ResponseType;
+
+	RequestAwaiter(Builder &builder, ResumeOn resumeOn) noexcept
+	: _builder(builder)
+	, _resumeOn(resumeOn) {
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+	void await_suspend(std::coroutine_handle<> handle) {
+		_builder.setHandler([
+			this,
+			guard = _builder.on_main_guard(),
+			resumer = CoroutineResumer(handle)
+		](Client::LibResponse response) mutable {
+			if (IsAutoResendError(*response)) {
+				return false;
+			}
+			_result = Convert(std::move(response));
+			if (_resumeOn == ResumeOn::Handler) {
+				resumer();
+			} else {
+				crl::on_main(guard, std::move(resumer));
+			}
+			return true;
+		});
+		_builder.send();
+	}
+	Result<Response> await_resume() {
+		return std::move(*_result);
+	}
+
+private:
+	[[nodiscard]] static Result<Response> Convert(
+			Client::LibResponse response) {
+		if (response->get_id() == tonlib_api::error::ID) {
+			return ErrorFromLib(tl_from(
+				tonlib_api::move_object_as<tonlib_api::error>(
+					std::move(response))));
+		}
+		using FPointer = std::decay_t<decltype(
+			tl_to(std::declval<const Request&>()))>;
+		using Function = typename FPointer::element_type;
+		using RPointer = typename Function::ReturnType;
+		using ReturnType = typename RPointer::element_type;
+		return tl_from(tonlib_api::move_object_as<ReturnType>(
+			std::move(response)));
+	}
+
+	// Temporaries of a co_await expression live until it is resumed.
+	Builder &_builder;
+	const ResumeOn _resumeOn = ResumeOn::Main;
+	std::optional<Result<Response>> _result;
+
+};
+
+template <typename Request>
+RequestAwaiter<Request> Await(
+		RequestSender::SpecificRequestBuilder<Request> &builder,
+		ResumeOn resumeOn = ResumeOn::Main) {
+	return RequestAwaiter<Request>(builder, resumeOn);
+}
+
+template <typename Request>
+RequestAwaiter<Request> Await(
+		RequestSender::SpecificRequestBuilder<Request> &&builder,
+		ResumeOn resumeOn = ResumeOn::Main) {
+	return RequestAwaiter<Request>(builder, resumeOn);
+}
+
+template <typename Request>
+RequestAwaiter<Request> operator co_await(
+		RequestSender::SpecificRequestBuilder<Request> &builder) {
+	return Await(builder);
+}
+
+template <typename Request>
+RequestAwaiter<Request> operator co_await(
+		RequestSender::SpecificRequestBuilder<Request> &&builder) {
+	return Await(builder);
+}
+
+} // namespace Ton::details
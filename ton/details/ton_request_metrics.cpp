@@ -0,0 +1,88 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ton/details/ton_request_metrics.h"
+
+#include <chrono>
+
+namespace Ton::details {
+namespace {
+
+[[nodiscard]] QString FunctionName(
+		const ::ton::tonlib_api::Function &function) {
+	// The text form starts with the function name.
+	const auto text = ::ton::tonlib_api::to_string(function);
+	return QString::fromStdString(text.substr(0, text.find_first_of(" {")));
+}
+
+} // namespace
+
+void LatencyHistogram::add(int64 duration) {
+	const auto i = ranges::lower_bound(kBounds, duration);
+	++buckets[i - begin(kBounds)];
+	++count;
+	total += duration;
+	max = std::max(max, duration);
+}
+
+int64 RequestMetrics::Now() {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+void RequestMetrics::started(const ::ton::tonlib_api::Function &function) {
+	++_inFlight;
+
+	QMutexLocker lock(&_mutex);
+	auto &metrics = _functions[function.get_id()];
+	if (!metrics.requests++) {
+		metrics.name = FunctionName(function);
+	}
+}
+
+void RequestMetrics::finished() {
+	--_inFlight;
+}
+
+void RequestMetrics::responded(int32 functionId, int64 latency) {
+	QMutexLocker lock(&_mutex);
+	_functions[functionId].latency.add(latency);
+}
+
+void RequestMetrics::handled(int32 functionId, int64 duration) {
+	QMutexLocker lock(&_mutex);
+	_functions[functionId].handler.add(duration);
+}
+
+void RequestMetrics::resent(int32 functionId) {
+	QMutexLocker lock(&_mutex);
+	++_functions[functionId].resends;
+	++_resends;
+}
+
+void RequestMetrics::timedOut(int32 functionId) {
+	QMutexLocker lock(&_mutex);
+	++_functions[functionId].timeouts;
+}
+
+void RequestMetrics::hopped(int64 duration) {
+	QMutexLocker lock(&_mutex);
+	_mainHop.add(duration);
+}
+
+RequestMetricsSnapshot RequestMetrics::snapshot() const {
+	auto result = RequestMetricsSnapshot();
+	result.inFlight = _inFlight;
+
+	QMutexLocker lock(&_mutex);
+	result.functions = _functions;
+	result.mainHop = _mainHop;
+	result.resends = _resends;
+	return result;
+}
+
+} // namespace Ton::details
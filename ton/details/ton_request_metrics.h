@@ -0,0 +1,94 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include <QtCore/QMutex>
+#include <auto/tl/tonlib_api.h>
+#include <array>
+#include <atomic>
+
+namespace Ton::details {
+
+// All durations are in microseconds.
+struct LatencyHistogram {
+	// Upper bounds of the buckets, the last one is unbounded.
+	static constexpr auto kBounds = std::array<int64, 16>{ {
+		100, 250, 500,
+		1'000, 2'500, 5'000,
+		10'000, 25'000, 50'000,
+		100'000, 250'000, 500'000,
+		1'000'000, 2'500'000, 5'000'000,
+		10'000'000,
+	} };
+
+	std::array<int64, kBounds.size() + 1> buckets = { { 0 } };
+	int64 count = 0;
+	int64 total = 0;
+	int64 max = 0;
+
+	void add(int64 duration);
+};
+
+struct FunctionMetrics {
+	QString name;
+	LatencyHistogram latency;
+	LatencyHistogram handler;
+	int64 requests = 0;
+	int64 resends = 0;
+	int64 timeouts = 0;
+};
+
+struct RequestMetricsSnapshot {
+	// By tonlib_api function ID.
+	base::flat_map<int32, FunctionMetrics> functions;
+	LatencyHistogram mainHop;
+	int64 resends = 0;
+	int inFlight = 0;
+	int queued = 0;
+};
+
+// Thread-safe, filled by the Client and the RequestSender.
+class RequestMetrics final {
+public:
+	[[nodiscard]] static int64 Now();
+
+	void started(const ::ton::tonlib_api::Function &function);
+	void finished();
+	void responded(int32 functionId, int64 latency);
+	void handled(int32 functionId, int64 duration);
+	void resent(int32 functionId);
+	void timedOut(int32 functionId);
+	void hopped(int64 duration);
+
+	[[nodiscard]] RequestMetricsSnapshot snapshot() const;
+
+private:
+	mutable QMutex _mutex;
+	base::flat_map<int32, FunctionMetrics> _functions;
+	LatencyHistogram _mainHop;
+	int64 _resends = 0;
+	std::atomic<int> _inFlight = 0;
+
+};
+
+// Posts the callback to main like crl::on_main and measures the hop.
+template <typename Guard, typename Callback>
+void OnMainMeasured(
+		not_null<RequestMetrics*> metrics,
+		Guard &&guard,
+		Callback &&callback) {
+	crl::on_main(std::forward<Guard>(guard), [
+		metrics,
+		posted = RequestMetrics::Now(),
+		callback = std::forward<Callback>(callback)
+	]() mutable {
+		metrics->hopped(RequestMetrics::Now() - posted);
+		callback();
+	});
+}
+
+} // namespace Ton::details
@@ -6,24 +6,13 @@
 //
 #include "ton/details/ton_request_sender.h"
 
+#include <QtCore/QDir>
+
 namespace Ton::details {
 namespace {
 
-[[nodiscard]] bool IsAutoResendError(
-		const tonlib_api::object_ptr<tonlib_api::error> &error) {
-	return (error->message_.find("LITE_SERVER_NETWORK") == 0)
-		|| (error->message_ == "CANCELLED");
-}
-
-[[nodiscard]] Fn<void(Client::LibUpdate)> ConvertUpdateCallback(
-		Fn<void(const TLUpdate &)> &&callback) {
-	if (!callback) {
-		return nullptr;
-	}
-	return [callback = std::move(callback)](Client::LibUpdate update) {
-		callback(tl_from(std::move(update)));
-	};
-}
+// Batch results that don't fill a chunk wait about a frame on main.
+constexpr auto kBatchDeliveryWindow = crl::time(16);
 
 } // namespace
 
@@ -34,6 +23,164 @@ Error ErrorFromLib(const TLerror &error) {
 	return { Error::Type::TonLib, message };
 }
 
+bool IsAutoResendError(const tonlib_api::Object &object) {
+	if (object.get_id() != tonlib_api::error::ID) {
+		return false;
+	}
+	const auto &error = static_cast<const tonlib_api::error&>(object);
+	return (error.message_.find("LITE_SERVER_NETWORK") == 0)
+		|| (error.message_ == "CANCELLED");
+}
+
+SharedClient::SharedClient(
+	const QString &keystorePath,
+	const ClientSettings &settings)
+: _keystorePath(keystorePath)
+, _client([=](Client::LibUpdate update) {
+	notify(std::move(update));
+}, settings) {
+}
+
+void SharedClient::init(Callback<> done) {
+	Expects(!_keystorePath.isEmpty());
+
+	if (_initialized) {
+		InvokeCallback(done);
+		return;
+	}
+	_initCallbacks.push_back(std::move(done));
+	if (_initCallbacks.size() > 1) {
+		return;
+	} else if (!QDir().mkpath(_keystorePath)) {
+		initDone(Error{ Error::Type::IO, _keystorePath });
+		return;
+	}
+	const auto weak = base::make_weak(this);
+	auto query = Client::Query();
+	query.request = [path = _keystorePath] {
+		return tl_to(TLInit(
+			tl_options(
+				nullptr,
+				tl_keyStoreTypeDirectory(tl_string(path)))));
+	};
+	query.handler = [=](Client::LibResponse response) {
+		if (IsAutoResendError(*response)) {
+			return false;
+		}
+		auto result = Result<>();
+		if (response->get_id() == tonlib_api::error::ID) {
+			result = tl::make_unexpected(ErrorFromLib(tl_from(
+				tonlib_api::move_object_as<tonlib_api::error>(
+					std::move(response)))));
+		}
+		crl::on_main(weak, [=] {
+			initDone(result);
+		});
+		return true;
+	};
+	_client.send(std::move(query));
+}
+
+void SharedClient::initDone(Result<> result) {
+	_initialized = result.has_value();
+	for (const auto &callback : base::take(_initCallbacks)) {
+		InvokeCallback(callback, result);
+	}
+}
+
+void SharedClient::configure(
+		not_null<const base::has_weak_ptr*> sender,
+		const TLconfig &config,
+		Callback<TLoptions_ConfigInfo> done) {
+	if (_configInfo) {
+		InvokeCallback(done, *_configInfo);
+		return;
+	}
+	_configCallbacks.push_back(std::move(done));
+	if (_configCallbacks.size() > 1) {
+		return;
+	}
+	_configOwner = base::make_weak(sender.get());
+	const auto weak = base::make_weak(this);
+	auto query = Client::Query();
+	query.request = [=] {
+		return tl_to(TLoptions_SetConfig(config));
+	};
+	query.handler = [=](Client::LibResponse response) {
+		if (IsAutoResendError(*response)) {
+			return false;
+		}
+		using FPointer = std::decay_t<decltype(
+			tl_to(std::declval<const TLoptions_SetConfig&>()))>;
+		using Function = typename FPointer::element_type;
+		using RPointer = typename Function::ReturnType;
+		using ReturnType = typename RPointer::element_type;
+		auto result = (response->get_id() == tonlib_api::error::ID)
+			? Result<TLoptions_ConfigInfo>(tl::make_unexpected(
+				ErrorFromLib(tl_from(
+					tonlib_api::move_object_as<tonlib_api::error>(
+						std::move(response))))))
+			: Result<TLoptions_ConfigInfo>(tl_from(
+				tonlib_api::move_object_as<ReturnType>(
+					std::move(response))));
+		crl::on_main(weak, [=] {
+			configured(result);
+		});
+		return true;
+	};
+	_client.send(std::move(query));
+}
+
+void SharedClient::configured(Result<TLoptions_ConfigInfo> result) {
+	if (result) {
+		_configInfo = *result;
+	} else {
+		_configOwner = base::weak_ptr<const base::has_weak_ptr>();
+	}
+	for (const auto &callback : base::take(_configCallbacks)) {
+		InvokeCallback(callback, result);
+	}
+}
+
+bool SharedClient::ownsConfig(not_null<const base::has_weak_ptr*> sender) {
+	if (_configInfo && !_configOwner) {
+		// The sender that set the config is gone, pass it on.
+		_configOwner = base::make_weak(sender.get());
+	}
+	return (_configOwner.get() == sender.get());
+}
+
+not_null<Client*> SharedClient::client() {
+	return &_client;
+}
+
+uint64 SharedClient::subscribe(Fn<void(const TLUpdate &)> callback) {
+	Expects(callback != nullptr);
+
+	QMutexLocker lock(&_subscribersMutex);
+	const auto result = ++_subscriptionAutoIncrement;
+	_subscribers.emplace(result, std::move(callback));
+	return result;
+}
+
+void SharedClient::unsubscribe(uint64 subscriptionId) {
+	QMutexLocker lock(&_subscribersMutex);
+	_subscribers.remove(subscriptionId);
+}
+
+void SharedClient::notify(Client::LibUpdate update) {
+	// Callbacks are invoked under the lock, so after unsubscribe()
+	// returns none of them is running or will run.
+	QMutexLocker lock(&_subscribersMutex);
+	if (_subscribers.empty()) {
+		return;
+	}
+	const auto converted = tl_from(std::move(update));
+	for (const auto &[subscriptionId, callback] : _subscribers) {
+		callback(converted);
+	}
+}
+
 RequestSender::RequestBuilder::RequestBuilder(
 	not_null<RequestSender*> sender) noexcept
 : _sender(sender) {
@@ -43,9 +190,10 @@ void RequestSender::RequestBuilder::setDoneOnMainHandler(
 		FnMut<void()> &&handler) noexcept {
 	setDoneHandler([
 		callback = std::move(handler),
-		guard = on_main_guard()
+		guard = on_main_guard(),
+		metrics = metrics()
 	](LibResponse result) mutable {
-		crl::on_main(guard, std::move(callback));
+		OnMainMeasured(metrics, guard, std::move(callback));
 	});
 }
 
@@ -53,12 +201,13 @@ void RequestSender::RequestBuilder::setFailOnMainHandler(
 		FnMut<void(const TLError&)> &&handler) noexcept {
 	setFailHandler([
 		callback = std::move(handler),
-		guard = on_main_guard()
+		guard = on_main_guard(),
+		metrics = metrics()
 	](LibError error) mutable {
-		if (IsAutoResendError(error)) {
+		if (IsAutoResendError(*error)) {
 			return false;
 		}
-		crl::on_main(guard, [
+		OnMainMeasured(metrics, guard, [
 			callback = std::move(callback),
 			error = tl_from(std::move(error))
 		]() mutable {
@@ -72,12 +221,13 @@ void RequestSender::RequestBuilder::setFailOnMainHandler(
 		FnMut<void()> &&handler) noexcept {
 	setFailHandler([
 		callback = std::move(handler),
-		guard = on_main_guard()
+		guard = on_main_guard(),
+		metrics = metrics()
 	](LibError error) mutable {
-		if (IsAutoResendError(error)) {
+		if (IsAutoResendError(*error)) {
 			return false;
 		}
-		crl::on_main(guard, std::move(callback));
+		OnMainMeasured(metrics, guard, std::move(callback));
 		return true;
 	});
 }
@@ -93,7 +243,7 @@ void RequestSender::RequestBuilder::setFailHandler(
 		FnMut<void(const TLError&)> &&handler) noexcept {
 	setFailHandler([callback = std::move(handler)](
 			LibError error) mutable {
-		if (IsAutoResendError(error)) {
+		if (IsAutoResendError(*error)) {
 			return false;
 		}
 		callback(tl_from(std::move(error)));
@@ -104,7 +254,7 @@ void RequestSender::RequestBuilder::setFailHandler(
 void RequestSender::RequestBuilder::setFailHandler(
 		FnMut<void()> &&handler) noexcept {
 	setFailHandler([callback = std::move(handler)](LibError error) mutable {
-		if (IsAutoResendError(error)) {
+		if (IsAutoResendError(*error)) {
 			return false;
 		}
 		callback();
@@ -122,9 +272,48 @@ void RequestSender::RequestBuilder::setFailHandler(
 	_fail = std::move(handler);
 }
 
-RequestId RequestSender::RequestBuilder::send(
-		Fn<LibRequest()> request) noexcept {
-	auto ready = [done = std::move(_done), fail = std::move(_fail)](
+void RequestSender::RequestBuilder::setHandler(
+		FnMut<bool(LibResponse)> &&handler) noexcept {
+	_handler = std::move(handler);
+}
+
+void RequestSender::RequestBuilder::setConvertedHandler(
+		FnMut<void(std::shared_ptr<const void>)> &&handler) noexcept {
+	_converted = std::move(handler);
+}
+
+void RequestSender::RequestBuilder::setOrdered() noexcept {
+	_ordered = true;
+}
+
+void RequestSender::RequestBuilder::setPriority(
+		RequestPriority priority) noexcept {
+	_priority = priority;
+}
+
+void RequestSender::RequestBuilder::setTimeout(crl::time timeout) noexcept {
+	_timeout = timeout;
+}
+
+void RequestSender::RequestBuilder::setGuard(
+		const base::has_weak_ptr *guard) noexcept {
+	if (guard) {
+		_guard = base::make_weak(guard);
+	} else {
+		_guard = std::nullopt;
+	}
+}
+
+bool RequestSender::RequestBuilder::guarded() const noexcept {
+	return _guard.has_value();
+}
+
+auto RequestSender::RequestBuilder::prepareHandler() noexcept
+-> FnMut<bool(LibResponse)> {
+	if (_handler) {
+		return std::move(_handler);
+	}
+	return [done = std::move(_done), fail = std::move(_fail)](
 			LibResponse response) mutable {
 		Expects(response != nullptr);
 
@@ -138,9 +327,105 @@ RequestId RequestSender::RequestBuilder::send(
 		}
 		return true;
 	};
-	return _sender->_client.send(
+}
+
+RequestId RequestSender::RequestBuilder::send(
+		Fn<LibRequest()> request) noexcept {
+	auto query = _sender->prepareQuery(
+		std::move(request),
+		prepareHandler(),
+		_priority);
+	query.ordered = _ordered;
+	query.timeout = _timeout;
+	query.guard = std::move(_guard);
+	return _sender->_client->send(std::move(query));
+}
+
+RequestId RequestSender::RequestBuilder::sendCoalesced(
+		std::string requestKey,
+		Fn<LibRequest()> request,
+		Fn<std::shared_ptr<const void>(LibResponse)> convert,
+		Fn<LibResponse(const void*)> restore) noexcept {
+	const auto sender = _sender;
+	const auto key = std::make_pair(_priority, std::move(requestKey));
+	const auto waiterId = sender->_client->reserveRequestId();
+	const auto deadline = _timeout ? (crl::now() + _timeout) : 0;
+	if (deadline) {
+		crl::on_main(on_main_guard(), [=] {
+			sender->checkCoalescedTimeoutsAt(deadline);
+		});
+	}
+
+	QMutexLocker lock(&sender->_coalescedMutex);
+	auto &coalesced = sender->_coalesced[key];
+	const auto fresh = (coalesced == nullptr);
+	if (fresh) {
+		coalesced = std::make_shared<CoalescedRequest>();
+	}
+	coalesced->waiters.push_back({
+		waiterId,
+		prepareHandler(),
+		std::move(_converted),
+		deadline
+	});
+	if (!fresh) {
+		return waiterId;
+	}
+
+	// The group is forgotten when all the waiters are detached.
+	const auto weak = std::weak_ptr<CoalescedRequest>(coalesced);
+	auto ready = [=](LibResponse response) {
+		if (IsAutoResendError(*response)) {
+			return false;
+		}
+		QMutexLocker lock(&sender->_coalescedMutex);
+		const auto group = weak.lock();
+		if (!group) {
+			return true;
+		}
+		const auto i = sender->_coalesced.find(key);
+		if (i != end(sender->_coalesced) && i->second == group) {
+			sender->_coalesced.erase(i);
+		}
+		auto waiters = base::take(group->waiters);
+		lock.unlock();
+
+		const auto failed = (response->get_id() == tonlib_api::error::ID);
+		if (waiters.empty()) {
+			return true;
+		} else if (waiters.size() == 1
+			&& (failed || !waiters.front().converted)) {
+			waiters.front().handler(std::move(response));
+			return true;
+		} else if (failed) {
+			const auto error = tonlib_api::move_object_as<tonlib_api::error>(
+				std::move(response));
+			for (auto &waiter : waiters) {
+				waiter.handler(tonlib_api::make_object<tonlib_api::error>(
+					error->code_,
+					error->message_));
+			}
+			return true;
+		}
+
+		// Waiters without a typed handler get a response made back.
+		const auto converted = convert(std::move(response));
+		for (auto &waiter : waiters) {
+			if (waiter.converted) {
+				waiter.converted(converted);
+			} else {
+				waiter.handler(restore(converted.get()));
+			}
+		}
+		return true;
+	};
+	auto query = sender->prepareQuery(
 		std::move(request),
-		std::move(ready));
+		std::move(ready),
+		_priority);
+	query.ordered = _ordered;
+	coalesced->requestId = sender->_client->send(std::move(query));
+	return waiterId;
 }
 
 auto RequestSender::RequestBuilder::on_main_guard() const
@@ -148,12 +433,187 @@ auto RequestSender::RequestBuilder::on_main_guard() const
 	return base::make_weak(_sender.get());
 }
 
-RequestSender::RequestSender(Fn<void(const TLUpdate &)> updateCallback)
-: _client(ConvertUpdateCallback(std::move(updateCallback))) {
+not_null<RequestMetrics*> RequestSender::RequestBuilder::metrics() const {
+	return _sender->_client->metrics();
+}
+
+RequestSender::RequestSender(
+	Fn<void(const TLUpdate &)> updateCallback,
+	const ClientSettings &settings)
+: RequestSender(
+	std::make_shared<SharedClient>(QString(), settings),
+	std::move(updateCallback),
+	false) {
+}
+
+RequestSender::RequestSender(
+	std::shared_ptr<SharedClient> shared,
+	Fn<void(const TLUpdate &)> updateCallback)
+: RequestSender(
+	(shared ? shared : std::make_shared<SharedClient>(QString())),
+	std::move(updateCallback),
+	(shared != nullptr)) {
+}
+
+RequestSender::RequestSender(
+	std::shared_ptr<SharedClient> shared,
+	Fn<void(const TLUpdate &)> updateCallback,
+	bool sharedMode)
+: _coalescedTimer([=] { checkCoalescedTimeouts(); })
+, _batchTimer([=] { flushBatches(); })
+, _gate(std::make_shared<Gate>())
+, _shared(std::move(shared))
+, _client(_shared->client())
+, _sharedMode(sharedMode) {
+	Expects(_shared != nullptr);
+
+	if (updateCallback) {
+		_subscriptionId = _shared->subscribe(std::move(updateCallback));
+	}
+}
+
+RequestSender::~RequestSender() {
+	if (_subscriptionId) {
+		_shared->unsubscribe(_subscriptionId);
+	}
+	QWriteLocker lock(&_gate->lock);
+	_gate->alive = false;
+}
+
+SharedClient *RequestSender::shared() const {
+	return _sharedMode ? _shared.get() : nullptr;
+}
+
+auto RequestSender::gated(FnMut<bool(LibResponse)> handler) const
+-> FnMut<bool(LibResponse)> {
+	return [gate = _gate, handler = std::move(handler)](
+			LibResponse response) mutable {
+		QReadLocker lock(&gate->lock);
+		return !gate->alive || handler(std::move(response));
+	};
+}
+
+Client::Query RequestSender::prepareQuery(
+		Fn<LibRequest()> request,
+		FnMut<bool(LibResponse)> handler,
+		RequestPriority priority) {
+	auto result = Client::Query();
+	result.request = std::move(request);
+	result.handler = gated(std::move(handler));
+	result.priority = priority;
+	if (_sharedMode) {
+		// Other senders keep the client alive, so our requests
+		// must not be resent or wait in the queue after we die.
+		result.owner = base::make_weak(
+			static_cast<const base::has_weak_ptr*>(this));
+	}
+	return result;
+}
+
+void RequestSender::cancel(RequestId requestId) {
+	QMutexLocker lock(&_coalescedMutex);
+	for (auto i = begin(_coalesced); i != end(_coalesced); ++i) {
+		auto &waiters = i->second->waiters;
+		const auto j = ranges::find(
+			waiters,
+			requestId,
+			&CoalescedWaiter::requestId);
+		if (j == end(waiters)) {
+			continue;
+		}
+		auto handler = std::move(j->handler);
+		auto converted = std::move(j->converted);
+		waiters.erase(j);
+		if (!waiters.empty()) {
+			return;
+		}
+		const auto shared = i->second->requestId;
+		_coalesced.erase(i);
+		lock.unlock();
+
+		_client->cancel(shared);
+		return;
+	}
+	lock.unlock();
+
+	_client->cancel(requestId);
+}
+
+void RequestSender::flushBatchLater(Fn<void()> flush) {
+	_batchFlushes.push_back(std::move(flush));
+	if (!_batchTimer.isActive()) {
+		_batchTimer.callOnce(kBatchDeliveryWindow);
+	}
+}
+
+void RequestSender::flushBatches() {
+	for (const auto &flush : base::take(_batchFlushes)) {
+		flush();
+	}
+}
+
+void RequestSender::checkCoalescedTimeoutsAt(crl::time deadline) {
+	if (_coalescedCheckAt && _coalescedCheckAt <= deadline) {
+		return;
+	}
+	_coalescedCheckAt = deadline;
+	_coalescedTimer.callOnce(std::max(deadline - crl::now(), crl::time(0)));
+}
+
+void RequestSender::checkCoalescedTimeouts() {
+	const auto now = crl::now();
+	auto expired = std::vector<FnMut<bool(LibResponse)>>();
+	auto cancelled = std::vector<RequestId>();
+	auto next = crl::time(0);
+
+	QMutexLocker lock(&_coalescedMutex);
+	for (auto &[key, coalesced] : _coalesced) {
+		auto &waiters = coalesced->waiters;
+		for (auto i = begin(waiters); i != end(waiters);) {
+			if (i->deadline && i->deadline <= now) {
+				expired.push_back(std::move(i->handler));
+				i = waiters.erase(i);
+				continue;
+			} else if (i->deadline && (!next || next > i->deadline)) {
+				next = i->deadline;
+			}
+			++i;
+		}
+		if (waiters.empty()) {
+			cancelled.push_back(coalesced->requestId);
+		}
+	}
+	for (auto i = begin(_coalesced); i != end(_coalesced);) {
+		if (i->second->waiters.empty()) {
+			i = _coalesced.erase(i);
+		} else {
+			++i;
+		}
+	}
+	lock.unlock();
+
+	for (const auto requestId : cancelled) {
+		_client->cancel(requestId);
+	}
+	_coalescedCheckAt = 0;
+	if (next) {
+		checkCoalescedTimeoutsAt(next);
+	}
+	for (auto &handler : expired) {
+		handler(Client::MakeTimeoutError());
+	}
 }
 
 rpl::producer<RequestId> RequestSender::resendingOnError() const {
-	return _client.resendingOnError();
+	return _client->resendingOnError(_sharedMode ? this : nullptr);
+}
+
+rpl::producer<bool> RequestSender::queueFull() const {
+	return _client->queueFull();
+}
+
+RequestMetricsSnapshot RequestSender::metrics() const {
+	return _client->metricsSnapshot();
 }
 
 } // namespace Ton::details
@@ -11,11 +11,72 @@
 #include "ton/details/ton_client.h"
 #include "ton/ton_result.h"
 #include "base/weak_ptr.h"
+#include "base/timer.h"
+
+#include <QtCore/QReadWriteLock>
 
 namespace Ton::details {
 
 [[nodiscard]] Error ErrorFromLib(const TLerror &error);
 
+// Network errors are resent by the Client, handlers skip them.
+[[nodiscard]] bool IsAutoResendError(const tonlib_api::Object &object);
+
+template <typename Response>
+struct BatchResult {
+	int index = 0;
+	Result<Response> result;
+};
+
+// One tonlib instance with one receive thread for many RequestSenders.
+// Each sender gets all the updates and drops its own requests when it is
+// destroyed. The keystore, the config and the network state live inside
+// tonlib, so they are common for all the senders of a client.
+class SharedClient final : public base::has_weak_ptr {
+public:
+	explicit SharedClient(
+		const QString &keystorePath,
+		const ClientSettings &settings = ClientSettings());
+
+	// Initializes tonlib once, later calls get the same result.
+	void init(Callback<> done);
+
+	// The first call sets the config, later ones get the same result.
+	// The sender that set it owns the config, only it may reset it.
+	void configure(
+		not_null<const base::has_weak_ptr*> sender,
+		const TLconfig &config,
+		Callback<TLoptions_ConfigInfo> done);
+	[[nodiscard]] bool ownsConfig(not_null<const base::has_weak_ptr*> sender);
+
+private:
+	friend class RequestSender;
+
+	[[nodiscard]] not_null<Client*> client();
+	[[nodiscard]] uint64 subscribe(Fn<void(const TLUpdate &)> callback);
+	void unsubscribe(uint64 subscriptionId);
+	void notify(Client::LibUpdate update);
+	void initDone(Result<> result);
+	void configured(Result<TLoptions_ConfigInfo> result);
+
+	const QString _keystorePath;
+
+	// Used by the update callback, so it must outlive the _client.
+	QMutex _subscribersMutex;
+	base::flat_map<uint64, Fn<void(const TLUpdate &)>> _subscribers;
+	uint64 _subscriptionAutoIncrement = 0;
+
+	Client _client;
+
+	// Accessed from main thread only.
+	std::vector<Callback<>> _initCallbacks;
+	bool _initialized = false;
+	std::vector<Callback<TLoptions_ConfigInfo>> _configCallbacks;
+	std::optional<TLoptions_ConfigInfo> _configInfo;
+	base::weak_ptr<const base::has_weak_ptr> _configOwner;
+
+};
+
 class RequestSender final : public base::has_weak_ptr {
 	using LibRequest = tonlib_api::object_ptr<tonlib_api::Function>;
 	using LibResponse = tonlib_api::object_ptr<tonlib_api::Object>;
@@ -39,13 +100,35 @@ class RequestSender final : public base::has_weak_ptr {
 		void setFailHandler(FnMut<void()> &&handler) noexcept;
 		void setDoneHandler(FnMut<void(LibResponse)> &&handler) noexcept;
 		void setFailHandler(FnMut<bool(LibError)> &&handler) noexcept;
+		void setHandler(FnMut<bool(LibResponse)> &&handler) noexcept;
+		void setConvertedHandler(
+			FnMut<void(std::shared_ptr<const void>)> &&handler) noexcept;
+		void setOrdered() noexcept;
+		void setPriority(RequestPriority priority) noexcept;
+		void setTimeout(crl::time timeout) noexcept;
+		void setGuard(const base::has_weak_ptr *guard) noexcept;
+		[[nodiscard]] bool guarded() const noexcept;
 		RequestId send(Fn<LibRequest()> request) noexcept;
+		RequestId sendCoalesced(
+			std::string requestKey,
+			Fn<LibRequest()> request,
+			Fn<std::shared_ptr<const void>(LibResponse)> convert,
+			Fn<LibResponse(const void*)> restore) noexcept;
 		base::weak_ptr<RequestSender> on_main_guard() const;
+		[[nodiscard]] not_null<RequestMetrics*> metrics() const;
 
 	private:
+		[[nodiscard]] FnMut<bool(LibResponse)> prepareHandler() noexcept;
+
 		const not_null<RequestSender*> _sender;
 		FnMut<void(LibResponse)> _done;
 		FnMut<bool(LibError)> _fail;
+		FnMut<bool(LibResponse)> _handler;
+		FnMut<void(std::shared_ptr<const void>)> _converted;
+		std::optional<base::weak_ptr<const base::has_weak_ptr>> _guard;
+		crl::time _timeout = 0;
+		RequestPriority _priority = RequestPriority::Normal;
+		bool _ordered = false;
 
 	};
 
@@ -54,6 +137,12 @@ public:
 	class SpecificRequestBuilder final : public RequestBuilder {
 	private:
 		friend class RequestSender;
+		template <typename>
+		friend class RequestAwaiter;
+
+		using Response = typename Request::ResponseType;
+		using SharedResponse = std::shared_ptr<const Response>;
+
 		SpecificRequestBuilder(
 			not_null<RequestSender*> sender,
 			Request &&request) noexcept
@@ -65,27 +154,24 @@ public:
 	public:
 		[[nodiscard]] SpecificRequestBuilder &done(FnMut<void()> callback) {
 			setDoneOnMainHandler(std::move(callback));
+			_resultHandler = nullptr;
 			return *this;
 		}
 		[[nodiscard]] SpecificRequestBuilder &done(
 			FnMut<void(
 				const typename Request::ResponseType &result)> callback) {
-			setDoneHandler([
+			_resultHandler = [
 				callback = std::move(callback),
-				guard = on_main_guard()
-			](LibResponse result) mutable {
-				using FPointer = std::decay_t<decltype(tl_to(_request))>;
-				using Function = typename FPointer::element_type;
-				using RPointer = typename Function::ReturnType;
-				using ReturnType = typename RPointer::element_type;
-				crl::on_main(guard, [
+				guard = on_main_guard(),
+				metrics = metrics()
+			](SharedResponse result) mutable {
+				OnMainMeasured(metrics, guard, [
 					callback = std::move(callback),
-					result = tl_from(tonlib_api::move_object_as<ReturnType>(
-						std::move(result)))
+					result = std::move(result)
 				]() mutable {
-					callback(result);
+					callback(*result);
 				});
-			});
+			};
 			return *this;
 		}
 		[[nodiscard]] SpecificRequestBuilder &fail(
@@ -102,20 +188,16 @@ public:
 		[[nodiscard]] SpecificRequestBuilder &done_async(
 				FnMut<void()> callback) {
 			setDoneHandler(std::move(callback));
+			_resultHandler = nullptr;
 			return *this;
 		}
 		[[nodiscard]] SpecificRequestBuilder &done_async(
 			FnMut<void(
 				const typename Request::ResponseType &result)> callback) {
-			setDoneHandler([callback = std::move(callback)](
-					LibResponse result) mutable {
-				using FPointer = std::decay_t<decltype(tl_to(_request))>;
-				using Function = typename FPointer::element_type;
-				using RPointer = typename Function::ReturnType;
-				using ReturnType = typename RPointer::element_type;
-				callback(tl_from(tonlib_api::move_object_as<ReturnType>(
-					std::move(result))));
-			});
+			_resultHandler = [callback = std::move(callback)](
+					SharedResponse result) mutable {
+				callback(*result);
+			};
 			return *this;
 		}
 		[[nodiscard]] SpecificRequestBuilder &fail_async(
@@ -129,19 +211,113 @@ public:
 			return *this;
 		}
 
+		[[nodiscard]] SpecificRequestBuilder &ordered() noexcept {
+			setOrdered();
+			return *this;
+		}
+
+		// Each priority has its own limit of requests running at once,
+		// so a wave of background requests doesn't delay the user.
+		[[nodiscard]] SpecificRequestBuilder &priority(
+				RequestPriority priority) noexcept {
+			setPriority(priority);
+			return *this;
+		}
+
+		// Fails with a TIMEOUT error if no response arrives in time,
+		// auto resends on network errors don't restart the timer.
+		[[nodiscard]] SpecificRequestBuilder &timeout(
+				crl::time timeout) noexcept {
+			setTimeout(timeout);
+			return *this;
+		}
+
+		// The request is forgotten as soon as the guard is destroyed,
+		// it won't be resent and no callbacks will be invoked.
+		// Passing nullptr leaves the request unguarded.
+		[[nodiscard]] SpecificRequestBuilder &guard(
+				const base::has_weak_ptr *guard) noexcept {
+			setGuard(guard);
+			return *this;
+		}
+
+		// Identical requests sent with coalesce() while one of them is
+		// still in flight share a single tonlib query and get copies
+		// of its response. Each of them has its own RequestId and
+		// timeout, the query is cancelled when none of them is left.
+		// Guarded requests are never coalesced, they may be abandoned.
+		// Only requests of the same priority are coalesced together.
+		[[nodiscard]] SpecificRequestBuilder &coalesce() noexcept {
+			_coalesce = true;
+			return *this;
+		}
+
 		RequestId send() {
+			if (_coalesce && !guarded()) {
+				return sendCoalesced();
+			} else if (_resultHandler) {
+				setDoneHandler([done = std::move(_resultHandler)](
+						LibResponse result) mutable {
+					done(std::make_shared<const Response>(
+						Convert(std::move(result))));
+				});
+			}
 			return RequestBuilder::send([copy = std::move(_request)] {
 				return tl_to(copy);
 			});
 		}
 
 	private:
+		[[nodiscard]] static Response Convert(LibResponse response) {
+			using FPointer = std::decay_t<decltype(
+				tl_to(std::declval<const Request&>()))>;
+			using Function = typename FPointer::element_type;
+			using RPointer = typename Function::ReturnType;
+			using ReturnType = typename RPointer::element_type;
+			return tl_from(tonlib_api::move_object_as<ReturnType>(
+				std::move(response)));
+		}
+
+		// The response is converted once and shared by all the waiters.
+		RequestId sendCoalesced() {
+			if (_resultHandler) {
+				setConvertedHandler([done = std::move(_resultHandler)](
+						std::shared_ptr<const void> result) mutable {
+					done(std::static_pointer_cast<const Response>(
+						std::move(result)));
+				});
+			}
+			auto key = tonlib_api::to_string(*tl_to(_request));
+			return RequestBuilder::sendCoalesced(
+				std::move(key),
+				[copy = std::move(_request)] { return tl_to(copy); },
+				[](LibResponse response) -> std::shared_ptr<const void> {
+					return std::make_shared<const Response>(
+						Convert(std::move(response)));
+				},
+				[](const void *result) -> LibResponse {
+					return tl_to(*static_cast<const Response*>(result));
+				});
+		}
+
 		Request _request;
+		FnMut<void(SharedResponse)> _resultHandler;
+		bool _coalesce = false;
 
 	};
 
 	explicit RequestSender(
+		Fn<void(const TLUpdate &)> updateCallback = nullptr,
+		const ClientSettings &settings = ClientSettings());
+
+	// Works with its own client if the shared one is null.
+	RequestSender(
+		std::shared_ptr<SharedClient> shared,
 		Fn<void(const TLUpdate &)> updateCallback = nullptr);
+	~RequestSender();
+
+	// Null unless the sender was created with a shared client.
+	[[nodiscard]] SharedClient *shared() const;
 
 	template <
 		typename Request,
@@ -160,15 +336,89 @@ public:
 		&& std::is_class_v<typename Request::Unboxed>>>
 	static Result<typename Request::ResponseType> Execute(Request &&request);
 
+	// Sends all requests at once and delivers their results on main,
+	// by chunkSize results in one callback or all of them if zero.
+	// Results that don't fill a chunk are delivered once a window.
+	// The timeout applies to each request on its own.
+	template <
+		typename Request,
+		typename = std::enable_if_t<
+		!std::is_reference_v<Request>
+		&& std::is_class_v<typename Request::ResponseType>
+		&& std::is_class_v<typename Request::Unboxed>>>
+	void requestBatch(
+		std::vector<Request> &&requests,
+		Fn<void(std::vector<BatchResult<typename Request::ResponseType>>)> done,
+		int chunkSize = 0,
+		RequestPriority priority = RequestPriority::Normal,
+		crl::time timeout = 0);
+
+	// Forgets the request, tonlib can't abort it, so a late response
+	// is just dropped. A coalesced request is detached from its group.
+	void cancel(RequestId requestId);
+
 	[[nodiscard]] rpl::producer<RequestId> resendingOnError() const;
+	[[nodiscard]] rpl::producer<bool> queueFull() const;
+
+	// May be called from any thread.
+	[[nodiscard]] RequestMetricsSnapshot metrics() const;
 
 private:
 	template <typename Request>
 	friend class SpecialRequestBuilder;
 	friend class RequestBuilder;
 
-	Client _client;
-	base::flat_set<RequestId> _requests;
+	struct CoalescedWaiter {
+		RequestId requestId = 0;
+		FnMut<bool(LibResponse)> handler;
+		FnMut<void(std::shared_ptr<const void>)> converted;
+		crl::time deadline = 0;
+	};
+	struct CoalescedRequest {
+		RequestId requestId = 0;
+		std::vector<CoalescedWaiter> waiters;
+	};
+
+	// The client may outlive the sender, so handlers that are running
+	// while it is destroyed are waited for and later ones are skipped.
+	struct Gate {
+		QReadWriteLock lock;
+		bool alive = true;
+	};
+
+	RequestSender(
+		std::shared_ptr<SharedClient> shared,
+		Fn<void(const TLUpdate &)> updateCallback,
+		bool sharedMode);
+
+	[[nodiscard]] FnMut<bool(LibResponse)> gated(
+		FnMut<bool(LibResponse)> handler) const;
+	[[nodiscard]] Client::Query prepareQuery(
+		Fn<LibRequest()> request,
+		FnMut<bool(LibResponse)> handler,
+		RequestPriority priority);
+	void checkCoalescedTimeoutsAt(crl::time deadline);
+	void checkCoalescedTimeouts();
+	void flushBatchLater(Fn<void()> flush);
+	void flushBatches();
+
+	// Used by the response handlers, so it must outlive the _client.
+	QMutex _coalescedMutex;
+	base::flat_map<
+		std::pair<RequestPriority, std::string>,
+		std::shared_ptr<CoalescedRequest>> _coalesced;
+
+	// Accessed from main thread only.
+	base::Timer _coalescedTimer;
+	crl::time _coalescedCheckAt = 0;
+	base::Timer _batchTimer;
+	std::vector<Fn<void()>> _batchFlushes;
+
+	const std::shared_ptr<Gate> _gate;
+	const std::shared_ptr<SharedClient> _shared;
+	const not_null<Client*> _client;
+	const bool _sharedMode = false;
+	uint64 _subscriptionId = 0;
 
 };
 
@@ -197,4 +447,97 @@ Result<typename Request::ResponseType> RequestSender::Execute(
 		std::move(response)));
 }
 
+template <typename Request, typename>
+void RequestSender::requestBatch(
+		std::vector<Request> &&requests,
+		Fn<void(std::vector<BatchResult<typename Request::ResponseType>>)> done,
+		int chunkSize,
+		RequestPriority priority,
+		crl::time timeout) {
+	Expects(done != nullptr);
+
+	using Response = typename Request::ResponseType;
+	using Results = std::vector<BatchResult<Response>>;
+	struct State {
+		QMutex mutex;
+		Results ready;
+		int left = 0;
+		bool flushing = false;
+	};
+
+	const auto count = int(requests.size());
+	if (!count) {
+		done(Results());
+		return;
+	}
+	const auto state = std::make_shared<State>();
+	state->left = count;
+	const auto chunk = (chunkSize > 0) ? std::min(chunkSize, count) : count;
+	const auto guard = base::make_weak(this);
+	const auto metrics = _client->metrics();
+	const auto flush = [=] {
+		QMutexLocker lock(&state->mutex);
+		state->flushing = false;
+		auto results = base::take(state->ready);
+		lock.unlock();
+
+		if (!results.empty()) {
+			done(std::move(results));
+		}
+	};
+
+	auto queries = std::vector<Client::Query>();
+	queries.reserve(count);
+	for (auto i = 0; i != count; ++i) {
+		auto handler = [=](LibResponse response) {
+			if (IsAutoResendError(*response)) {
+				return false;
+			}
+			using FPointer = std::decay_t<decltype(
+				tl_to(std::declval<const Request&>()))>;
+			using Function = typename FPointer::element_type;
+			using RPointer = typename Function::ReturnType;
+			using ReturnType = typename RPointer::element_type;
+			auto result = (response->get_id() == tonlib_api::error::ID)
+				? Result<Response>(tl::make_unexpected(ErrorFromLib(tl_from(
+					tonlib_api::move_object_as<tonlib_api::error>(
+						std::move(response))))))
+				: Result<Response>(tl_from(
+					tonlib_api::move_object_as<ReturnType>(
+						std::move(response))));
+
+			QMutexLocker lock(&state->mutex);
+			state->ready.push_back({ i, std::move(result) });
+			if (--state->left > 0 && int(state->ready.size()) < chunk) {
+				if (!state->flushing) {
+					state->flushing = true;
+					lock.unlock();
+
+					crl::on_main(guard, [=] {
+						flushBatchLater(flush);
+					});
+				}
+				return true;
+			}
+			auto results = base::take(state->ready);
+			lock.unlock();
+
+			OnMainMeasured(metrics, guard, [
+				=,
+				results = std::move(results)
+			]() mutable {
+				done(std::move(results));
+			});
+			return true;
+		};
+		auto query = prepareQuery(
+			[copy = std::move(requests[i])] { return tl_to(copy); },
+			std::move(handler),
+			priority);
+		query.timeout = timeout;
+		queries.push_back(std::move(query));
+	}
+	_client->send(std::move(queries));
+}
+
 } // namespace Ton::details
@@ -0,0 +1,151 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ton/details/ton_resend_scheduler.h"
+
+#include <cmath>
+
+namespace Ton::details {
+namespace {
+
+constexpr auto kMinResendDelay = crl::time(100);
+constexpr auto kMaxResendDelay = 10 * crl::time(1000);
+constexpr auto kResendBudget = 50.;
+constexpr auto kResendBudgetPerSecond = 10.;
+constexpr auto kFailuresTillOpen = 16;
+constexpr auto kMinOpenDuration = crl::time(1000);
+constexpr auto kMaxOpenDuration = 30 * crl::time(1000);
+constexpr auto kCloseSpreadDuration = crl::time(1000);
+
+} // namespace
+
+ResendScheduler::ResendScheduler(Fn<void(RequestId)> resend)
+: _resend(std::move(resend))
+, _generator(std::random_device()())
+, _tokens(kResendBudget)
+, _tokensUpdated(crl::now())
+, _openDuration(kMinOpenDuration)
+, _thread([=] { run(); }) {
+}
+
+ResendScheduler::~ResendScheduler() {
+	stop();
+}
+
+void ResendScheduler::stop() {
+	QMutexLocker lock(&_mutex);
+	_finished = true;
+	_wakeup.wakeAll();
+	lock.unlock();
+
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+void ResendScheduler::failed(RequestId requestId, int attempt) {
+	const auto now = crl::now();
+
+	QMutexLocker lock(&_mutex);
+	_healthy = false;
+	++_failuresInRow;
+	if (_state == State::HalfOpen
+		|| (_state == State::Closed && _failuresInRow >= kFailuresTillOpen)) {
+		open(now);
+	}
+	_queue.emplace(now + delay(attempt), requestId);
+	_wakeup.wakeOne();
+}
+
+void ResendScheduler::succeeded() {
+	if (_healthy) {
+		return;
+	}
+	const auto now = crl::now();
+
+	QMutexLocker lock(&_mutex);
+	_failuresInRow = 0;
+	if (_state != State::Closed) {
+		_state = State::Closed;
+		_openDuration = kMinOpenDuration;
+
+		// Spread the resends held by the open circuit.
+		auto held = std::vector<RequestId>();
+		while (!_queue.empty() && _queue.begin()->first <= now) {
+			held.push_back(_queue.begin()->second);
+			_queue.erase(_queue.begin());
+		}
+		for (const auto requestId : held) {
+			_queue.emplace(now + jitter(kCloseSpreadDuration), requestId);
+		}
+		_wakeup.wakeOne();
+	}
+	_healthy = true;
+}
+
+void ResendScheduler::open(crl::time now) {
+	_state = State::Open;
+	_openTill = now + _openDuration;
+	_openDuration = std::min(_openDuration * 2, kMaxOpenDuration);
+}
+
+void ResendScheduler::refill(crl::time now) {
+	const auto passed = now - _tokensUpdated;
+	_tokensUpdated = now;
+	_tokens = std::min(
+		_tokens + (passed * kResendBudgetPerSecond / 1000.),
+		kResendBudget);
+}
+
+crl::time ResendScheduler::delay(int attempt) {
+	const auto max = (attempt < 7)
+		? std::min(kMinResendDelay << attempt, kMaxResendDelay)
+		: kMaxResendDelay;
+	return (max / 2) + jitter(max / 2);
+}
+
+crl::time ResendScheduler::jitter(crl::time max) {
+	return std::uniform_int_distribution<crl::time>(0, max)(_generator);
+}
+
+void ResendScheduler::run() {
+	QMutexLocker lock(&_mutex);
+	while (!_finished) {
+		if (_queue.empty()) {
+			_wakeup.wait(&_mutex);
+			continue;
+		}
+		const auto now = crl::now();
+		auto wakeAt = _queue.begin()->first;
+		if (_state != State::Closed) {
+			wakeAt = std::max(wakeAt, _openTill);
+		}
+		refill(now);
+		if (_tokens < 1.) {
+			const auto wait = (1. - _tokens) * 1000. / kResendBudgetPerSecond;
+			wakeAt = std::max(wakeAt, now + crl::time(std::ceil(wait)));
+		}
+		if (wakeAt > now) {
+			_wakeup.wait(&_mutex, static_cast<unsigned long>(wakeAt - now));
+			continue;
+		}
+		const auto requestId = _queue.begin()->second;
+		_queue.erase(_queue.begin());
+		_tokens -= 1.;
+		if (_state != State::Closed) {
+			// Let a single probe through while the circuit is open.
+			_state = State::HalfOpen;
+			_openTill = now + _openDuration;
+		}
+		lock.unlock();
+
+		_resend(requestId);
+
+		lock.relock();
+	}
+}
+
+} // namespace Ton::details
@@ -0,0 +1,74 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <map>
+
+namespace Ton::details {
+
+using RequestId = uint32;
+
+// Resends requests failed with network errors on its own thread.
+//
+// Delays grow exponentially with jitter, so failed requests don't retry
+// in lockstep. All resends share a token bucket budget. After many
+// failures in a row the circuit opens and resends wait until a single
+// probe request succeeds.
+class ResendScheduler final {
+public:
+	explicit ResendScheduler(Fn<void(RequestId)> resend);
+	~ResendScheduler();
+
+	// The attempt counts failures of this request, starting from zero.
+	void failed(RequestId requestId, int attempt);
+	void succeeded();
+
+	// Waits for a running resend, no resends are made after it returns.
+	void stop();
+
+private:
+	enum class State {
+		Closed,
+		Open,
+		HalfOpen,
+	};
+
+	void run();
+	void refill(crl::time now);
+	void open(crl::time now);
+	[[nodiscard]] crl::time delay(int attempt);
+	[[nodiscard]] crl::time jitter(crl::time max);
+
+	const Fn<void(RequestId)> _resend;
+
+	QMutex _mutex;
+	QWaitCondition _wakeup;
+	std::multimap<crl::time, RequestId> _queue;
+	std::mt19937 _generator;
+
+	double _tokens = 0.;
+	crl::time _tokensUpdated = 0;
+
+	State _state = State::Closed;
+	int _failuresInRow = 0;
+	crl::time _openTill = 0;
+	crl::time _openDuration = 0;
+
+	// Lets succeeded() skip the lock while nothing fails.
+	std::atomic<bool> _healthy = true;
+
+	bool _finished = false;
+	std::thread _thread;
+
+};
+
+} // namespace Ton::details
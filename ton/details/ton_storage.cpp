@@ -7,11 +7,15 @@
 #include "ton/details/ton_storage.h"
 
 #include "ton/details/ton_request_sender.h"
+#include "ton/details/ton_address.h"
+#include "ton/details/ton_storage_compact.h"
 #include "ton/ton_state.h"
 #include "ton/ton_settings.h"
 #include "storage/cache/storage_cache_database.h"
 #include "ton_storage_tl.h"
 
+#include <atomic>
+
 namespace Ton::details {
 namespace {
 
@@ -19,25 +23,68 @@ constexpr auto kSettingsKey = Storage::Cache::Key{ 1ULL, 0ULL };
 constexpr auto kWalletTestListKey = Storage::Cache::Key{ 1ULL, 1ULL };
 constexpr auto kWalletMainListKey = Storage::Cache::Key{ 1ULL, 2ULL };
 
+// Cached history pages of a wallet share this many slots,
+// a new page overwrites the one that took its slot before.
+constexpr auto kTransactionsPageSlotsShift = 6;
+
 [[nodiscard]] Storage::Cache::Key WalletListKey(bool useTestNetwork) {
 	return useTestNetwork
 		? kWalletTestListKey
 		: kWalletMainListKey;
 }
 
-[[nodiscard]] Storage::Cache::Key WalletStateKey(const QString &address) {
-	const auto utf8 = address.toUtf8();
-	const auto decoded = QByteArray::fromBase64(
-		address.toUtf8(),
-		QByteArray::Base64UrlEncoding);
-	Assert(decoded.size() == 36);
+[[nodiscard]] Storage::Cache::Key WalletStateKey(const Address &address) {
 	auto a = uint64();
 	auto b = uint64();
-	memcpy(&a, decoded.data() + 2, sizeof(uint64));
-	memcpy(&b, decoded.data() + 2 + sizeof(uint64), sizeof(uint64));
+	memcpy(&a, address.hash.data(), sizeof(uint64));
+	memcpy(&b, address.hash.data() + sizeof(uint64), sizeof(uint64));
 	return { 0x2ULL | (a & 0xFFFFFFFFFFFF0000ULL), b };
 }
 
+[[nodiscard]] std::optional<Storage::Cache::Key> WalletStateKey(
+		const QString &address) {
+	const auto parsed = ParseAddress(address);
+	return parsed
+		? std::make_optional(WalletStateKey(parsed->raw))
+		: std::nullopt;
+}
+
+[[nodiscard]] Storage::Cache::Key TransactionKey(
+		const Storage::Cache::Key &walletStateKey,
+		int64 lt) {
+	return {
+		0x3ULL | (walletStateKey.high & 0xFFFFFFFFFFFF0000ULL),
+		walletStateKey.low ^ uint64(lt)
+	};
+}
+
+[[nodiscard]] Storage::Cache::Key TransactionsPageKey(
+		const Storage::Cache::Key &walletStateKey,
+		const TransactionId &lastId) {
+	const auto &key = walletStateKey;
+	const auto slot = (uint64(lastId.lt) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - kTransactionsPageSlotsShift);
+	return {
+		0x4ULL | (key.high & 0xFFFFFFFFFFFF0000ULL),
+		key.low ^ slot
+	};
+}
+
+// Transactions of the lastTransactions slice are stored separately.
+struct WalletHead {
+	QString address;
+	AccountState account;
+	std::vector<TransactionId> transactionIds;
+	TransactionId previousId;
+	std::vector<PendingTransaction> pendingTransactions;
+};
+
+struct TransactionsPage {
+	QString address;
+	TransactionId lastId;
+	TransactionsSlice slice;
+};
+
 [[nodiscard]] QString ConvertLegacyUrl(const QString &configUrl) {
 	return (configUrl == "https://test.ton.org/config.json")
 		? "https://ton.org/config-test.json"
@@ -70,6 +117,9 @@ TLstorage_PendingTransaction Serialize(const PendingTransaction &data);
 PendingTransaction Deserialize(const TLstorage_PendingTransaction &data);
 TLstorage_WalletState Serialize(const WalletState &data);
 WalletState Deserialize(const TLstorage_WalletState &data);
+TLstorage_WalletHead Serialize(const WalletHead &data);
+WalletHead Deserialize(const TLstorage_WalletHead &data);
+TLstorage_TransactionsPage Serialize(const TransactionsPage &data);
 TLstorage_Settings Serialize(const Settings &data);
 Settings Deserialize(const TLstorage_Settings &data);
 
@@ -263,14 +313,7 @@ Message Deserialize(const TLstorage_Message &data) {
 }
 
 TLstorage_Transaction Serialize(const Transaction &data) {
-	return make_storage_transaction(
-		Serialize(data.id),
-		tl_int64(data.time),
-		tl_int64(data.fee),
-		tl_int64(data.storageFee),
-		tl_int64(data.otherFee),
-		Serialize(data.incoming),
-		Serialize(data.outgoing));
+	return make_storage_transactionCompact(tl_bytes(PackCompact(data)));
 }
 
 Transaction Deserialize(const TLstorage_Transaction &data) {
@@ -284,13 +327,18 @@ Transaction Deserialize(const TLstorage_Transaction &data) {
 			Deserialize(data.vincoming()),
 			Deserialize(data.voutgoing())
 		};
+	}, [&](const TLDstorage_transactionCompact &data) {
+		const auto &bytes = data.vdata().v;
+		return UnpackCompactTransaction(
+			bytes.constData(),
+			bytes.size()
+		).value_or(Transaction());
 	});
 }
 
 TLstorage_TransactionsSlice Serialize(const TransactionsSlice &data) {
-	return make_storage_transactionsSlice(
-		Serialize(data.list),
-		Serialize(data.previousId));
+	return make_storage_transactionsSliceCompact(
+		tl_bytes(PackCompact(data)));
 }
 
 TransactionsSlice Deserialize(const TLstorage_TransactionsSlice &data) {
@@ -299,6 +347,12 @@ TransactionsSlice Deserialize(const TLstorage_TransactionsSlice &data) {
 			Deserialize(data.vlist()),
 			Deserialize(data.vpreviousId())
 		};
+	}, [&](const TLDstorage_transactionsSliceCompact &data) {
+		const auto &bytes = data.vdata().v;
+		return UnpackCompactSlice(
+			bytes.constData(),
+			bytes.size()
+		).value_or(TransactionsSlice());
 	});
 }
 
@@ -336,6 +390,35 @@ WalletState Deserialize(const TLstorage_WalletState &data) {
 	});
 }
 
+TLstorage_WalletHead Serialize(const WalletHead &data) {
+	return make_storage_walletHead(
+		tl_string(data.address),
+		Serialize(data.account),
+		Serialize(data.transactionIds),
+		Serialize(data.previousId),
+		Serialize(data.pendingTransactions));
+}
+
+WalletHead Deserialize(const TLstorage_WalletHead &data) {
+	return data.match([&](const TLDstorage_walletHead &data) {
+		return WalletHead{
+			tl::utf16(data.vaddress()),
+			Deserialize(data.vaccount()),
+			Deserialize(data.vtransactionIds()),
+			Deserialize(data.vpreviousId()),
+			Deserialize(data.vpendingTransactions())
+		};
+	});
+}
+
+TLstorage_TransactionsPage Serialize(const TransactionsPage &data) {
+	return make_storage_transactionsPage(
+		tl_string(data.address),
+		Serialize(data.lastId),
+		make_storage_transactionsSliceCompact(
+			tl_bytes(PackCompact(data.slice, data.address))));
+}
+
 TLstorage_Network Serialize(const NetSettings &data) {
 	return make_storage_network(
 		tl_string(data.blockchainName),
@@ -423,6 +506,377 @@ Data Unpack(const QByteArray &data) {
 	return result.read(from, till) ? Deserialize(result) : Data();
 }
 
+// Records of the wallet transactions don't repeat the wallet address.
+[[nodiscard]] QByteArray PackTransaction(
+		const Transaction &data,
+		const QString &owner) {
+	const auto packed = make_storage_transactionCompact(
+		tl_bytes(PackCompact(data, owner)));
+	auto result = QByteArray();
+	result.reserve(tl::count_length(packed));
+	packed.write(result);
+	return result;
+}
+
+// Reads the records written by the generated code straight into
+// the Ton structs, without building the TL objects first. Anything
+// unexpected marks it failed and the generated reader is used instead.
+class DirectReader final {
+public:
+	DirectReader(const QByteArray &data, const QString &owner)
+	: _from(data.constData())
+	, _end(data.constData() + data.size())
+	, _owner(owner) {
+	}
+
+	[[nodiscard]] bool failed() const {
+		return _failed || (_from != _end);
+	}
+
+	[[nodiscard]] Transaction readTransaction();
+	[[nodiscard]] TransactionsPage readTransactionsPage();
+
+private:
+	using Reader = tl::Reader<char>;
+
+	// Vectors are prefixed by this id in the boxed form.
+	static constexpr auto kVectorTypeId = uint32(0x1CB5C415U);
+
+	void fail() {
+		_failed = true;
+		_from = _end;
+	}
+	[[nodiscard]] uint32 readPrime();
+	[[nodiscard]] int64 readInt64();
+	[[nodiscard]] std::pair<const char*, int> readRawBytes();
+	[[nodiscard]] QByteArray readBytes();
+	[[nodiscard]] QString readString();
+	[[nodiscard]] int readCount();
+	[[nodiscard]] TransactionId readTransactionId();
+	[[nodiscard]] MessageText readMessageText();
+	[[nodiscard]] Message readMessage();
+	[[nodiscard]] TransactionsSlice readTransactionsSlice();
+
+	const char *_from = nullptr;
+	const char *_end = nullptr;
+	QString _owner;
+	bool _failed = false;
+
+};
+
+uint32 DirectReader::readPrime() {
+	if (!Reader::Has(1, _from, _end)) {
+		fail();
+		return 0;
+	}
+	return Reader::Get(_from, _end);
+}
+
+int64 DirectReader::readInt64() {
+	auto result = int64();
+	if (!Reader::HasBytes(sizeof(result), _from, _end)) {
+		fail();
+		return 0;
+	}
+	Reader::GetBytes(&result, sizeof(result), _from, _end);
+	return result;
+}
+
+std::pair<const char*, int> DirectReader::readRawBytes() {
+	if (!Reader::Has(1, _from, _end)) {
+		fail();
+		return {};
+	}
+	const auto first = uchar(_from[0]);
+	const auto header = (first < 254) ? 1 : 4;
+	const auto length = (first < 254)
+		? int(first)
+		: (int(uchar(_from[1]))
+			| (int(uchar(_from[2])) << 8)
+			| (int(uchar(_from[3])) << 16));
+	const auto padded = (header + length + 3) & ~3;
+	if (first == 255 || (_end - _from) < padded) {
+		fail();
+		return {};
+	}
+	const auto result = std::make_pair(_from + header, length);
+	_from += padded;
+	return result;
+}
+
+QByteArray DirectReader::readBytes() {
+	const auto [data, length] = readRawBytes();
+	return QByteArray(data, length);
+}
+
+QString DirectReader::readString() {
+	const auto [data, length] = readRawBytes();
+	return QString::fromUtf8(data, length);
+}
+
+int DirectReader::readCount() {
+	auto result = readPrime();
+	if (result == kVectorTypeId) {
+		result = readPrime();
+	}
+	// Each element takes at least one prime.
+	if (!Reader::Has(result, _from, _end)) {
+		fail();
+		return 0;
+	}
+	return int(result);
+}
+
+TransactionId DirectReader::readTransactionId() {
+	auto result = TransactionId();
+	if (readPrime() != id_storage_transactionId) {
+		fail();
+		return result;
+	}
+	result.lt = readInt64();
+	result.hash = readBytes();
+	return result;
+}
+
+MessageText DirectReader::readMessageText() {
+	auto result = MessageText();
+	switch (readPrime()) {
+	case id_storage_messageTextEncrypted:
+		result.encrypted = readBytes();
+		break;
+	case id_storage_messageTextDecrypted:
+		result.text = readString();
+		result.decrypted = true;
+		break;
+	case id_storage_messageTextPlain:
+		result.text = readString();
+		break;
+	default:
+		fail();
+	}
+	return result;
+}
+
+Message DirectReader::readMessage() {
+	auto result = Message();
+	const auto type = readPrime();
+	if (type != id_storage_message && type != id_storage_message2) {
+		fail();
+		return result;
+	}
+	result.source = readString();
+	result.destination = readString();
+	result.value = readInt64();
+	result.created = readInt64();
+	result.bodyHash = readBytes();
+	if (type == id_storage_message) {
+		result.message.text = readString();
+	} else {
+		result.message = readMessageText();
+	}
+	return result;
+}
+
+Transaction DirectReader::readTransaction() {
+	auto result = Transaction();
+	const auto type = readPrime();
+	if (type == id_storage_transactionCompact) {
+		const auto [data, length] = readRawBytes();
+		if (auto parsed = UnpackCompactTransaction(data, length, _owner)) {
+			return std::move(*parsed);
+		}
+		fail();
+		return result;
+	} else if (type != id_storage_transaction) {
+		fail();
+		return result;
+	}
+	result.id = readTransactionId();
+	result.time = readInt64();
+	result.fee = readInt64();
+	result.storageFee = readInt64();
+	result.otherFee = readInt64();
+	result.incoming = readMessage();
+	const auto count = readCount();
+	result.outgoing.reserve(count);
+	for (auto i = 0; i != count && !_failed; ++i) {
+		result.outgoing.push_back(readMessage());
+	}
+	return result;
+}
+
+TransactionsSlice DirectReader::readTransactionsSlice() {
+	auto result = TransactionsSlice();
+	const auto type = readPrime();
+	if (type == id_storage_transactionsSliceCompact) {
+		const auto [data, length] = readRawBytes();
+		if (auto parsed = UnpackCompactSlice(data, length, _owner)) {
+			return std::move(*parsed);
+		}
+		fail();
+		return result;
+	} else if (type != id_storage_transactionsSlice) {
+		fail();
+		return result;
+	}
+	const auto count = readCount();
+	result.list.reserve(count);
+	for (auto i = 0; i != count && !_failed; ++i) {
+		result.list.push_back(readTransaction());
+	}
+	result.previousId = readTransactionId();
+	return result;
+}
+
+TransactionsPage DirectReader::readTransactionsPage() {
+	auto result = TransactionsPage();
+	if (readPrime() != id_storage_transactionsPage) {
+		fail();
+		return result;
+	}
+	result.address = readString();
+	result.lastId = readTransactionId();
+	_owner = result.address;
+	result.slice = readTransactionsSlice();
+	return result;
+}
+
+[[nodiscard]] Transaction UnpackTransaction(
+		const QByteArray &data,
+		const QString &owner) {
+	auto reader = DirectReader(data, owner);
+	auto result = reader.readTransaction();
+	if (reader.failed()) {
+		return Unpack<Transaction>(data);
+	}
+	return result;
+}
+
+// The direct reader knows every page layout, so its failure means
+// corrupt data. The generic path would turn it into an empty slice.
+[[nodiscard]] std::optional<TransactionsPage> UnpackTransactionsPage(
+		const QByteArray &data) {
+	auto reader = DirectReader(data, QString());
+	auto result = reader.readTransactionsPage();
+	if (reader.failed()) {
+		return std::nullopt;
+	}
+	return result;
+}
+
+[[nodiscard]] WalletState AssembleWalletState(
+		WalletHead &&head,
+		std::vector<std::optional<Transaction>> &&loaded) {
+	auto result = WalletState{
+		head.address,
+		std::move(head.account),
+		TransactionsSlice{ {}, std::move(head.previousId) },
+		std::move(head.pendingTransactions)
+	};
+	auto &slice = result.lastTransactions;
+	slice.list.reserve(loaded.size());
+	for (auto i = 0, count = int(loaded.size()); i != count; ++i) {
+		if (!loaded[i]) {
+			// Load the rest from the network, starting with the lost one.
+			slice.previousId = head.transactionIds[i];
+			break;
+		}
+		slice.list.push_back(std::move(*loaded[i]));
+	}
+	return result;
+}
+
+void LoadTransactions(
+		not_null<Storage::Cache::Database*> db,
+		base::weak_ptr<const base::has_weak_ptr> guard,
+		Storage::Cache::Key stateKey,
+		WalletHead &&head,
+		Fn<void(WalletState&&)> done) {
+	struct State {
+		WalletHead head;
+		std::vector<std::optional<Transaction>> loaded;
+		std::atomic<int> left = 0;
+	};
+	const auto count = int(head.transactionIds.size());
+	if (!count) {
+		done(AssembleWalletState(std::move(head), {}));
+		return;
+	}
+	const auto state = std::make_shared<State>();
+	state->head = std::move(head);
+	state->loaded.resize(count);
+	state->left = count;
+	for (auto i = 0; i != count; ++i) {
+		const auto lt = state->head.transactionIds[i].lt;
+		db->get(TransactionKey(stateKey, lt), [=](QByteArray value) {
+			auto transaction = UnpackTransaction(
+				value,
+				state->head.address);
+			if (transaction.id == state->head.transactionIds[i]) {
+				state->loaded[i] = std::move(transaction);
+			}
+			if (--state->left > 0) {
+				return;
+			}
+			crl::on_main(guard, [=] {
+				done(AssembleWalletState(
+					std::move(state->head),
+					std::move(state->loaded)));
+			});
+		});
+	}
+}
+
+void LoadHistoryPages(
+		not_null<Storage::Cache::Database*> db,
+		const QString &address,
+		not_null<const base::has_weak_ptr*> guard,
+		std::vector<Transaction> &&list,
+		const TransactionId &previousId,
+		Fn<void(std::vector<Transaction>&&)> done) {
+	if (!previousId.lt) {
+		done(std::move(list));
+		return;
+	}
+	auto loaded = [=, list = std::move(list)](
+			std::optional<TransactionsSlice> &&slice) mutable {
+		if (!slice) {
+			done(std::move(list));
+			return;
+		}
+		const auto last = list.empty() ? 0 : list.back().id.lt;
+		for (auto &transaction : slice->list) {
+			if (!last || transaction.id.lt < last) {
+				list.push_back(std::move(transaction));
+			}
+		}
+		const auto previous = slice->previousId;
+		if (!list.empty() && previous.lt >= list.back().id.lt) {
+			// Broken chain, don't loop over the same pages.
+			done(std::move(list));
+			return;
+		}
+		LoadHistoryPages(
+			db,
+			address,
+			guard,
+			std::move(list),
+			previous,
+			std::move(done));
+	};
+	LoadTransactionsPage(db, address, previousId, guard, std::move(loaded));
+}
+
+void MigrateLegacyWalletState(
+		not_null<Storage::Cache::Database*> db,
+		const WalletState &state) {
+	// Callers treat the loaded state as stored and later save only the
+	// transactions that differ from it. So every transaction record is
+	// written now, with an empty stored state, and the head goes after
+	// them, replacing the single legacy blob.
+	SaveWalletState(db, state, WalletState(), nullptr);
+}
+
 } // namespace
 
 std::optional<Error> ErrorFromStorage(const Storage::Cache::Error &error) {
@@ -486,11 +940,61 @@ void LoadWalletList(
 void SaveWalletState(
 		not_null<Storage::Cache::Database*> db,
 		const WalletState &state,
+		const WalletState &stored,
 		Callback<> done) {
 	if (state == WalletState{ state.address }) {
 		InvokeCallback(done);
 		return;
 	}
+	const auto &address = state.address;
+	const auto parsed = WalletStateKey(address);
+	if (!parsed) {
+		// Not an account address, nothing could be loaded for it either.
+		InvokeCallback(done);
+		return;
+	}
+	const auto key = *parsed;
+
+	// Records keep the owner address implicitly, in the form it had,
+	// so after the form changes they all are written once again.
+	const auto sameForm = (stored.address == address);
+	auto storedByLt = base::flat_map<int64, const Transaction*>();
+	if (SameAddress(stored.address, address)) {
+		for (const auto &transaction : stored.lastTransactions.list) {
+			storedByLt.emplace(transaction.id.lt, &transaction);
+		}
+	}
+	auto head = WalletHead{
+		address,
+		state.account,
+		{},
+		state.lastTransactions.previousId,
+		state.pendingTransactions
+	};
+	head.transactionIds.reserve(state.lastTransactions.list.size());
+	for (const auto &transaction : state.lastTransactions.list) {
+		const auto lt = transaction.id.lt;
+		head.transactionIds.push_back(transaction.id);
+		// Transaction::operator==() looks only at ids, while the content
+		// may change later, like a comment that got decrypted.
+		auto packed = PackTransaction(transaction, address);
+		const auto i = storedByLt.find(lt);
+		if (i == end(storedByLt)) {
+			db->put(TransactionKey(key, lt), std::move(packed));
+		} else {
+			if (!sameForm
+				|| PackTransaction(*i->second, address) != packed) {
+				db->put(TransactionKey(key, lt), std::move(packed));
+			}
+			storedByLt.erase(i);
+		}
+	}
+	for (const auto &[lt, transaction] : storedByLt) {
+		db->remove(TransactionKey(key, lt));
+	}
+
+	// The head goes last, so it never points to an unwritten record.
+	// If a record write fails the loaded slice is cut before it.
 	auto saved = [=](Storage::Cache::Error error) {
 		crl::on_main([=] {
 			if (const auto bad = ErrorFromStorage(error)) {
@@ -500,21 +1004,117 @@ void SaveWalletState(
 			}
 		});
 	};
-	db->put(WalletStateKey(state.address), Pack(state), std::move(saved));
+	db->put(key, Pack(head), std::move(saved));
 }
 
 void LoadWalletState(
 		not_null<Storage::Cache::Database*> db,
 		const QString &address,
+		not_null<const base::has_weak_ptr*> guard,
 		Fn<void(WalletState&&)> done) {
 	Expects(done != nullptr);
 
-	db->get(WalletStateKey(address), [=](QByteArray value) {
-		crl::on_main([=, result = Unpack<WalletState>(value)]() mutable {
-			done((result.address == address)
-				? std::move(result)
-				: WalletState{ address });
+	const auto weak = base::make_weak(guard.get());
+	const auto key = WalletStateKey(address);
+	if (!key) {
+		crl::on_main(weak, [=] {
+			done(WalletState{ address });
+		});
+		return;
+	}
+	db->get(*key, [=](QByteArray value) {
+		auto head = Unpack<WalletHead>(value);
+		if (SameAddress(head.address, address)) {
+			crl::on_main(weak, [=, head = std::move(head)]() mutable {
+				LoadTransactions(db, weak, *key, std::move(head), done);
+			});
+			return;
+		}
+
+		// Written before transactions were stored one by one.
+		auto result = Unpack<WalletState>(value);
+		crl::on_main(weak, [=, result = std::move(result)]() mutable {
+			if (!SameAddress(result.address, address)) {
+				done(WalletState{ address });
+				return;
+			}
+			MigrateLegacyWalletState(db, result);
+			done(std::move(result));
+		});
+	});
+}
+
+void SaveTransactionsPage(
+		not_null<Storage::Cache::Database*> db,
+		const QString &address,
+		const TransactionId &lastId,
+		const TransactionsSlice &slice,
+		Callback<> done) {
+	const auto key = WalletStateKey(address);
+	if (!key) {
+		InvokeCallback(done);
+		return;
+	}
+	auto saved = [=](Storage::Cache::Error error) {
+		crl::on_main([=] {
+			if (const auto bad = ErrorFromStorage(error)) {
+				InvokeCallback(done, *bad);
+			} else {
+				InvokeCallback(done);
+			}
+		});
+	};
+	db->put(
+		TransactionsPageKey(*key, lastId),
+		Pack(TransactionsPage{ address, lastId, slice }),
+		std::move(saved));
+}
+
+void LoadTransactionsPage(
+		not_null<Storage::Cache::Database*> db,
+		const QString &address,
+		const TransactionId &lastId,
+		not_null<const base::has_weak_ptr*> guard,
+		Fn<void(std::optional<TransactionsSlice>&&)> done) {
+	Expects(done != nullptr);
+
+	const auto weak = base::make_weak(guard.get());
+	const auto key = WalletStateKey(address);
+	if (!key) {
+		crl::on_main(weak, [=] {
+			done(std::nullopt);
 		});
+		return;
+	}
+	db->get(TransactionsPageKey(*key, lastId), [=](QByteArray value) {
+		auto page = UnpackTransactionsPage(value);
+		auto result = (page
+			&& SameAddress(page->address, address)
+			&& page->lastId == lastId)
+			? std::make_optional(std::move(page->slice))
+			: std::nullopt;
+		crl::on_main(weak, [=, result = std::move(result)]() mutable {
+			done(std::move(result));
+		});
+	});
+}
+
+void LoadStoredHistory(
+		not_null<Storage::Cache::Database*> db,
+		const QString &address,
+		not_null<const base::has_weak_ptr*> guard,
+		Fn<void(std::vector<Transaction>&&)> done) {
+	Expects(done != nullptr);
+
+	LoadWalletState(db, address, guard, [=](WalletState &&state) {
+		auto &last = state.lastTransactions;
+		LoadHistoryPages(
+			db,
+			address,
+			guard,
+			std::move(last.list),
+			last.previousId,
+			done);
 	});
 }
 
@@ -24,6 +24,10 @@ struct WalletState;
 struct Settings;
 } // namespace Ton
 
+namespace base {
+class has_weak_ptr;
+} // namespace base
+
 namespace Ton::details {
 
 class RequestSender;
@@ -56,15 +60,45 @@ void LoadWalletList(
 	bool useTestNetwork,
 	Fn<void(WalletList&&)> done);
 
+// Each transaction is stored in its own record, so only the ones that
+// differ from the stored state are written.
 void SaveWalletState(
 	not_null<Storage::Cache::Database*> db,
 	const WalletState &state,
+	const WalletState &stored,
 	Callback<> done);
+
+// The database must outlive the guard, done is invoked while it's alive.
 void LoadWalletState(
 	not_null<Storage::Cache::Database*> db,
 	const QString &address,
+	not_null<const base::has_weak_ptr*> guard,
 	Fn<void(WalletState&&)> done);
 
+// Pages of history before some transaction never change, so they are
+// served without the network. Only a few pages per wallet are kept,
+// a page in the same slot replaces the older one.
+void SaveTransactionsPage(
+	not_null<Storage::Cache::Database*> db,
+	const QString &address,
+	const TransactionId &lastId,
+	const TransactionsSlice &slice,
+	Callback<> done);
+void LoadTransactionsPage(
+	not_null<Storage::Cache::Database*> db,
+	const QString &address,
+	const TransactionId &lastId,
+	not_null<const base::has_weak_ptr*> guard,
+	Fn<void(std::optional<TransactionsSlice>&&)> done);
+
+// The stored state and the cached pages before it, newest first,
+// until the first page that is not in the database.
+void LoadStoredHistory(
+	not_null<Storage::Cache::Database*> db,
+	const QString &address,
+	not_null<const base::has_weak_ptr*> guard,
+	Fn<void(std::vector<Transaction>&&)> done);
+
 void SaveSettings(
 	not_null<Storage::Cache::Database*> db,
 	const Settings &settings,
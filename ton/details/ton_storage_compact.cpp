@@ -0,0 +1,431 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ton/details/ton_storage_compact.h"
+
+#include "ton/details/ton_address.h"
+#include "ton/ton_state.h"
+
+namespace Ton::details {
+namespace {
+
+constexpr auto kMaxVarintSize = 10;
+constexpr auto kHashSize = 32;
+
+// The lowest bit of the dictionary size tells that the owner address
+// takes index 0 without being written.
+constexpr auto kOwnerImplicitFlag = uint64(1);
+
+enum class AddressKind : uchar {
+	String = 0x00,
+	Raw = 0x01,
+	RawNonBounceable = 0x02,
+	RawTestnet = 0x04,
+};
+
+enum class TextKind : uchar {
+	Plain = 0,
+	Decrypted = 1,
+	Encrypted = 2,
+};
+
+[[nodiscard]] uint64 ZigZag(int64 value) {
+	return (uint64(value) << 1) ^ uint64(value >> 63);
+}
+
+[[nodiscard]] int64 UnZigZag(uint64 value) {
+	return int64(value >> 1) ^ -int64(value & 1);
+}
+
+class CompactWriter final {
+public:
+	explicit CompactWriter(const QString &owner);
+
+	void putTransaction(const Transaction &data);
+	void putTransactionId(const TransactionId &data);
+	void putCount(int count);
+
+	[[nodiscard]] QByteArray finish();
+
+private:
+	static void PutVarint(QByteArray &to, uint64 value);
+	static void PutBytes(QByteArray &to, const QByteArray &value);
+	static void PutDictionaryEntry(QByteArray &to, const QString &address);
+
+	void putSigned(int64 value);
+	void putBytes(const QByteArray &value);
+	void putAddress(const QString &address);
+	void putMessage(const Message &data, int64 time);
+
+	QByteArray _body;
+	base::flat_map<QString, int> _indices;
+	std::vector<QString> _addresses;
+	int _implicit = 0;
+	int64 _lastLt = 0;
+	int64 _lastTime = 0;
+
+};
+
+class CompactReader final {
+public:
+	CompactReader(const char *data, int size, const QString &owner);
+
+	[[nodiscard]] bool failed() const {
+		return _failed || (_from != _till);
+	}
+
+	[[nodiscard]] Transaction getTransaction();
+	[[nodiscard]] TransactionId getTransactionId();
+	[[nodiscard]] int getCount();
+
+private:
+	void fail() {
+		_failed = true;
+		_from = _till;
+	}
+	[[nodiscard]] uint64 getVarint();
+	[[nodiscard]] int64 getSigned();
+	[[nodiscard]] std::pair<const char*, int> getRawBytes();
+	[[nodiscard]] QByteArray getBytes();
+	[[nodiscard]] QString getString();
+	[[nodiscard]] QString getDictionaryEntry();
+	[[nodiscard]] QString getAddress();
+	[[nodiscard]] Message getMessage(int64 time);
+
+	const char *_from = nullptr;
+	const char *_till = nullptr;
+	std::vector<QString> _addresses;
+	int64 _lastLt = 0;
+	int64 _lastTime = 0;
+	bool _failed = false;
+
+};
+
+CompactWriter::CompactWriter(const QString &owner) {
+	if (!owner.isEmpty()) {
+		_indices.emplace(owner, 0);
+		_implicit = 1;
+	}
+}
+
+void CompactWriter::PutVarint(QByteArray &to, uint64 value) {
+	while (value >= 0x80) {
+		to.append(char(uchar(value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	to.append(char(uchar(value)));
+}
+
+void CompactWriter::PutBytes(QByteArray &to, const QByteArray &value) {
+	PutVarint(to, uint64(value.size()));
+	to.append(value);
+}
+
+void CompactWriter::PutDictionaryEntry(
+		QByteArray &to,
+		const QString &address) {
+	// Most addresses are in the user-friendly form, 34 bytes instead of 49.
+	// Others are kept as they are, so that each one is read back exactly.
+	const auto parsed = ParseAddress(address);
+	if (!parsed || !IsFormattedAddress(address)) {
+		to.append(char(AddressKind::String));
+		PutBytes(to, address.toUtf8());
+		return;
+	}
+	to.append(char(uchar(AddressKind::Raw)
+		| (parsed->bounceable ? 0 : uchar(AddressKind::RawNonBounceable))
+		| (parsed->testnet ? uchar(AddressKind::RawTestnet) : 0)));
+	to.append(char(int8(parsed->raw.workchain)));
+	to.append(
+		reinterpret_cast<const char*>(parsed->raw.hash.data()),
+		kHashSize);
+}
+
+void CompactWriter::putSigned(int64 value) {
+	PutVarint(_body, ZigZag(value));
+}
+
+void CompactWriter::putBytes(const QByteArray &value) {
+	PutBytes(_body, value);
+}
+
+void CompactWriter::putCount(int count) {
+	PutVarint(_body, uint64(count));
+}
+
+void CompactWriter::putAddress(const QString &address) {
+	const auto i = _indices.find(address);
+	if (i != end(_indices)) {
+		PutVarint(_body, uint64(i->second));
+		return;
+	}
+	const auto index = _implicit + int(_addresses.size());
+	_indices.emplace(address, index);
+	_addresses.push_back(address);
+	PutVarint(_body, uint64(index));
+}
+
+void CompactWriter::putMessage(const Message &data, int64 time) {
+	putAddress(data.source);
+	putAddress(data.destination);
+	putSigned(data.value);
+	putSigned(data.created - time);
+	putBytes(data.bodyHash);
+	const auto &text = data.message;
+	if (!text.encrypted.isEmpty()) {
+		_body.append(char(TextKind::Encrypted));
+		putBytes(text.encrypted);
+	} else {
+		_body.append(char(text.decrypted
+			? TextKind::Decrypted
+			: TextKind::Plain));
+		putBytes(text.text.toUtf8());
+	}
+}
+
+void CompactWriter::putTransactionId(const TransactionId &data) {
+	putSigned(data.lt - _lastLt);
+	_lastLt = data.lt;
+	putBytes(data.hash);
+}
+
+void CompactWriter::putTransaction(const Transaction &data) {
+	putTransactionId(data.id);
+	putSigned(data.time - _lastTime);
+	_lastTime = data.time;
+	putSigned(data.fee);
+	putSigned(data.storageFee);
+	putSigned(data.otherFee);
+	putMessage(data.incoming, data.time);
+	putCount(int(data.outgoing.size()));
+	for (const auto &message : data.outgoing) {
+		putMessage(message, data.time);
+	}
+}
+
+QByteArray CompactWriter::finish() {
+	auto result = QByteArray();
+	result.reserve(kMaxVarintSize + _addresses.size() * 50 + _body.size());
+	PutVarint(
+		result,
+		(uint64(_addresses.size()) << 1)
+			| (_implicit ? kOwnerImplicitFlag : 0));
+	for (const auto &address : _addresses) {
+		PutDictionaryEntry(result, address);
+	}
+	result.append(_body);
+	return result;
+}
+
+CompactReader::CompactReader(
+	const char *data,
+	int size,
+	const QString &owner)
+: _from(data)
+, _till(data + size) {
+	const auto header = getVarint();
+	const auto count = (header >> 1);
+	// Each entry takes at least one byte.
+	if (count > uint64(_till - _from)) {
+		fail();
+		return;
+	}
+	if (header & kOwnerImplicitFlag) {
+		if (owner.isEmpty()) {
+			fail();
+			return;
+		}
+		_addresses.push_back(owner);
+	}
+	_addresses.reserve(_addresses.size() + count);
+	for (auto i = uint64(); i != count && !_failed; ++i) {
+		_addresses.push_back(getDictionaryEntry());
+	}
+}
+
+uint64 CompactReader::getVarint() {
+	auto result = uint64();
+	for (auto shift = 0; shift < 7 * kMaxVarintSize; shift += 7) {
+		if (_from == _till) {
+			break;
+		}
+		const auto byte = uchar(*_from++);
+		result |= uint64(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return result;
+		}
+	}
+	fail();
+	return 0;
+}
+
+int64 CompactReader::getSigned() {
+	return UnZigZag(getVarint());
+}
+
+int CompactReader::getCount() {
+	const auto result = getVarint();
+	// Each element takes at least one byte.
+	if (result > uint64(_till - _from)) {
+		fail();
+		return 0;
+	}
+	return int(result);
+}
+
+std::pair<const char*, int> CompactReader::getRawBytes() {
+	const auto size = getCount();
+	const auto result = std::make_pair(_from, size);
+	_from += size;
+	return result;
+}
+
+QByteArray CompactReader::getBytes() {
+	const auto [data, size] = getRawBytes();
+	return QByteArray(data, size);
+}
+
+QString CompactReader::getString() {
+	const auto [data, size] = getRawBytes();
+	return QString::fromUtf8(data, size);
+}
+
+QString CompactReader::getDictionaryEntry() {
+	if (_from == _till) {
+		fail();
+		return QString();
+	}
+	const auto kind = uchar(*_from++);
+	if (kind == uchar(AddressKind::String)) {
+		return getString();
+	} else if (!(kind & uchar(AddressKind::Raw))
+		|| (kind & ~uchar(0x07))
+		|| (_till - _from) < 1 + kHashSize) {
+		fail();
+		return QString();
+	}
+	auto parsed = AccountAddress();
+	parsed.bounceable = !(kind & uchar(AddressKind::RawNonBounceable));
+	parsed.testnet = (kind & uchar(AddressKind::RawTestnet)) != 0;
+	parsed.raw.workchain = int32(int8(*_from++));
+	std::copy(_from, _from + kHashSize, parsed.raw.hash.begin());
+	_from += kHashSize;
+	return FormatAddress(parsed);
+}
+
+QString CompactReader::getAddress() {
+	const auto index = getVarint();
+	if (index >= _addresses.size()) {
+		fail();
+		return QString();
+	}
+	return _addresses[index];
+}
+
+Message CompactReader::getMessage(int64 time) {
+	auto result = Message();
+	result.source = getAddress();
+	result.destination = getAddress();
+	result.value = getSigned();
+	result.created = time + getSigned();
+	result.bodyHash = getBytes();
+	if (_from == _till) {
+		fail();
+		return result;
+	}
+	switch (TextKind(*_from++)) {
+	case TextKind::Encrypted:
+		result.message.encrypted = getBytes();
+		break;
+	case TextKind::Decrypted:
+		result.message.text = getString();
+		result.message.decrypted = true;
+		break;
+	case TextKind::Plain:
+		result.message.text = getString();
+		break;
+	default:
+		fail();
+	}
+	return result;
+}
+
+TransactionId CompactReader::getTransactionId() {
+	auto result = TransactionId();
+	result.lt = _lastLt + getSigned();
+	_lastLt = result.lt;
+	result.hash = getBytes();
+	return result;
+}
+
+Transaction CompactReader::getTransaction() {
+	auto result = Transaction();
+	result.id = getTransactionId();
+	result.time = _lastTime + getSigned();
+	_lastTime = result.time;
+	result.fee = getSigned();
+	result.storageFee = getSigned();
+	result.otherFee = getSigned();
+	result.incoming = getMessage(result.time);
+	const auto count = getCount();
+	result.outgoing.reserve(count);
+	for (auto i = 0; i != count && !_failed; ++i) {
+		result.outgoing.push_back(getMessage(result.time));
+	}
+	return result;
+}
+
+} // namespace
+
+QByteArray PackCompact(const Transaction &data, const QString &owner) {
+	auto writer = CompactWriter(owner);
+	writer.putTransaction(data);
+	return writer.finish();
+}
+
+QByteArray PackCompact(
+		const TransactionsSlice &data,
+		const QString &owner) {
+	auto writer = CompactWriter(owner);
+	writer.putCount(int(data.list.size()));
+	for (const auto &transaction : data.list) {
+		writer.putTransaction(transaction);
+	}
+	writer.putTransactionId(data.previousId);
+	return writer.finish();
+}
+
+std::optional<Transaction> UnpackCompactTransaction(
+		const char *data,
+		int size,
+		const QString &owner) {
+	auto reader = CompactReader(data, size, owner);
+	auto result = reader.getTransaction();
+	if (reader.failed()) {
+		return std::nullopt;
+	}
+	return result;
+}
+
+std::optional<TransactionsSlice> UnpackCompactSlice(
+		const char *data,
+		int size,
+		const QString &owner) {
+	auto reader = CompactReader(data, size, owner);
+	auto result = TransactionsSlice();
+	const auto count = reader.getCount();
+	result.list.reserve(count);
+	for (auto i = 0; i != count; ++i) {
+		result.list.push_back(reader.getTransaction());
+	}
+	result.previousId = reader.getTransactionId();
+	if (reader.failed()) {
+		return std::nullopt;
+	}
+	return result;
+}
+
+} // namespace Ton::details
@@ -0,0 +1,39 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include <optional>
+
+namespace Ton {
+struct Transaction;
+struct TransactionsSlice;
+} // namespace Ton
+
+namespace Ton::details {
+
+// Compact encoding of transactions for the local storage.
+// Addresses are written once to a dictionary and referenced by index,
+// lt and time are delta-encoded and all the numbers are varints.
+// The owner address, usually the wallet itself, is not written at all
+// and the same owner must be passed to read the data back.
+[[nodiscard]] QByteArray PackCompact(
+	const Transaction &data,
+	const QString &owner = QString());
+[[nodiscard]] QByteArray PackCompact(
+	const TransactionsSlice &data,
+	const QString &owner = QString());
+
+[[nodiscard]] std::optional<Transaction> UnpackCompactTransaction(
+	const char *data,
+	int size,
+	const QString &owner = QString());
+[[nodiscard]] std::optional<TransactionsSlice> UnpackCompactSlice(
+	const char *data,
+	int size,
+	const QString &owner = QString());
+
+} // namespace Ton::details
@@ -83,11 +83,12 @@ void AccountViewer::preloadSlice(const TransactionId &lastId) {
 		};
 		_wallet->trySilentDecrypt(_publicKey, std::move(result->list), done);
 	};
-	_wallet->requestTransactions(
+	_wallet->requestHistoryTransactions(
 		_publicKey,
 		_address,
 		lastId,
-		crl::guard(this, done));
+		crl::guard(this, done),
+		this);
 }
 
 } // namespace Ton
@@ -0,0 +1,50 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "base/basic_types.h"
+
+namespace Ton {
+
+// Layout of the files written by Wallet::exportHistorySnapshot.
+//
+// The file starts with the header, followed by the columns at the given
+// offsets from the start of the file, each aligned to 8 bytes. All the
+// numbers are little-endian. Transactions go from the newest to the
+// oldest, so the file can be memory-mapped and scanned without parsing.
+//
+//   int64 lt[count];
+//   int64 time[count];
+//   int64 value[count]; // Incoming minus outgoing, in nanograms.
+//   int64 fee[count];
+//   int32 counterparty[count]; // Index in counterparties or -1.
+//   HistorySnapshotAddress counterparties[counterpartiesCount];
+struct HistorySnapshotHeader {
+	static constexpr auto kMagic = uint32(0x484E4F54); // "TONH"
+	static constexpr auto kVersion = uint32(1);
+
+	uint32 magic = kMagic;
+	uint32 version = kVersion;
+	int32 count = 0;
+	int32 counterpartiesCount = 0;
+	int64 ltOffset = 0;
+	int64 timeOffset = 0;
+	int64 valueOffset = 0;
+	int64 feeOffset = 0;
+	int64 counterpartyOffset = 0;
+	int64 counterpartiesOffset = 0;
+};
+
+struct HistorySnapshotAddress {
+	int32 workchain = 0;
+	uchar hash[32] = { 0 };
+};
+
+static_assert(sizeof(HistorySnapshotHeader) == 64);
+static_assert(sizeof(HistorySnapshotAddress) == 36);
+
+} // namespace Ton
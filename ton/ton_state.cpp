@@ -6,8 +6,23 @@
 //
 #include "ton/ton_state.h"
 
+#include "ton/details/ton_address.h"
+
 namespace Ton {
 
+bool operator==(const Address &a, const Address &b) {
+	return (a.workchain == b.workchain) && (a.hash == b.hash);
+}
+
+bool operator!=(const Address &a, const Address &b) {
+	return !(a == b);
+}
+
+bool operator<(const Address &a, const Address &b) {
+	return (a.workchain < b.workchain)
+		|| (a.workchain == b.workchain && a.hash < b.hash);
+}
+
 bool operator<(const TransactionId &a, const TransactionId &b) {
 	return (a.lt < b.lt);
 }
@@ -66,7 +81,7 @@ bool operator!=(const PendingTransaction &a, const PendingTransaction &b) {
 }
 
 bool operator==(const WalletState &a, const WalletState &b) {
-	return (a.address == b.address)
+	return details::SameAddress(a.address, b.address)
 		&& (a.account == b.account)
 		&& (a.lastTransactions == b.lastTransactions)
 		&& (a.pendingTransactions == b.pendingTransactions);
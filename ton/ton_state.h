@@ -8,10 +8,23 @@
 
 #include "ton/ton_settings.h"
 
+#include <array>
+
 namespace Ton {
 
 inline constexpr auto kUnknownBalance = int64(-666);
 
+// Raw account address, user-friendly strings are made and parsed
+// only at the API edge by Wallet::FormatAddress / Wallet::ParseAddress.
+struct Address {
+	std::array<uchar, 32> hash = { { 0 } };
+	int32 workchain = 0;
+};
+
+bool operator==(const Address &a, const Address &b);
+bool operator!=(const Address &a, const Address &b);
+bool operator<(const Address &a, const Address &b);
+
 struct ConfigInfo {
 	int64 walletId = 0;
 	QByteArray restrictedInitPublicKey;
@@ -170,6 +183,34 @@ struct SyncState {
 bool operator==(const SyncState &a, const SyncState &b);
 bool operator!=(const SyncState &a, const SyncState &b);
 
+// All durations are in microseconds.
+struct RequestsLatency {
+	// Upper bounds of the buckets, the last bucket is unbounded.
+	std::vector<int64> bounds;
+	std::vector<int64> buckets;
+	int64 count = 0;
+	int64 total = 0;
+	int64 max = 0;
+};
+
+struct FunctionRequestsMetrics {
+	int32 functionId = 0; // tonlib_api constructor ID.
+	QString name; // tonlib_api function name, like "getAccountState".
+	RequestsLatency latency;
+	RequestsLatency handler;
+	int64 requests = 0;
+	int64 resends = 0;
+	int64 timeouts = 0;
+};
+
+struct RequestsMetrics {
+	std::vector<FunctionRequestsMetrics> functions;
+	RequestsLatency mainHop;
+	int64 resends = 0;
+	int inFlight = 0;
+	int queued = 0;
+};
+
 struct LiteServerQuery {
 	int64 id = 0;
 	QByteArray bytes;
@@ -7,11 +7,15 @@
 #include "ton/ton_wallet.h"
 
 #include "ton/details/ton_account_viewers.h"
+#include "ton/details/ton_address.h"
 #include "ton/details/ton_request_sender.h"
+#include "ton/details/ton_request_awaiter.h"
 #include "ton/details/ton_key_creator.h"
 #include "ton/details/ton_key_destroyer.h"
 #include "ton/details/ton_password_changer.h"
 #include "ton/details/ton_external.h"
+#include "ton/details/ton_storage.h"
+#include "ton/details/ton_history_snapshot.h"
 #include "ton/details/ton_parse_state.h"
 #include "ton/details/ton_web_loader.h"
 #include "ton/ton_settings.h"
@@ -33,6 +37,8 @@ namespace {
 using namespace details;
 
 constexpr auto kViewersPasswordExpires = 15 * 60 * crl::time(1000);
+constexpr auto kRefreshRequestTimeout = 60 * crl::time(1000);
+constexpr auto kStatesChunkSize = 16;
 constexpr auto kDefaultSmcRevision = 0;
 constexpr auto kLegacySmcRevision = 1;
 constexpr auto kDefaultWorkchainId = 0;
@@ -41,6 +47,49 @@ constexpr auto kDefaultWorkchainId = 0;
 	return tl_error(tl_int32(0), tl_string("KEY_DECRYPT"));
 }
 
+RequestFlow CheckSendGrams(
+		not_null<RequestSender*> lib,
+		QString sender,
+		TransactionToSend transaction,
+		Callback<TransactionCheckResult> done) {
+	const auto info = co_await lib->request(TLCreateQuery(
+		tl_inputKeyFake(),
+		tl_accountAddress(tl_string(sender)),
+		tl_int32(transaction.timeout),
+		tl_actionMsg(
+			tl_vector(1, tl_msg_message(
+				tl_accountAddress(tl_string(transaction.recipient)),
+				tl_string(),
+				tl_int64(transaction.amount),
+				(transaction.sendUnencryptedText
+					? tl_msg_dataText
+					: tl_msg_dataDecryptedText)(
+						tl_string(transaction.comment)))),
+			tl_from(transaction.allowSendToUninited)),
+		tl_raw_initialAccountState(tl_bytes(), tl_bytes()) // doesn't matter
+	)).priority(RequestPriority::Interactive);
+	if (!info) {
+		InvokeCallback(done, info.error());
+		co_return;
+	}
+	const auto id = info->match([&](const TLDquery_info &data) {
+		return data.vid().v;
+	});
+
+	const auto fees = co_await lib->request(TLquery_EstimateFees(
+		tl_int53(id),
+		tl_boolTrue()
+	)).priority(RequestPriority::Interactive);
+	if (!fees) {
+		InvokeCallback(done, fees.error());
+		co_return;
+	}
+	lib->request(TLquery_Forget(
+		tl_int53(id)
+	)).priority(RequestPriority::Interactive).send();
+	InvokeCallback(done, Parse(*fees));
+}
+
 } // namespace
 
 namespace details {
@@ -54,7 +103,16 @@ struct UnpackedAddress {
 } // namespace details
 
 Wallet::Wallet(const QString &path)
-: _external(std::make_unique<External>(path, generateUpdatesCallback()))
+: Wallet(path, nullptr) {
+}
+
+Wallet::Wallet(
+	const QString &path,
+	std::shared_ptr<details::SharedClient> client)
+: _external(std::make_unique<External>(
+	path,
+	generateUpdatesCallback(),
+	std::move(client)))
 , _accountViewers(
 	std::make_unique<AccountViewers>(
 		this,
@@ -74,6 +132,11 @@ Wallet::Wallet(const QString &path)
 
 Wallet::~Wallet() = default;
 
+auto Wallet::CreateSharedClient(const QString &keystorePath)
+-> std::shared_ptr<SharedClient> {
+	return std::make_shared<SharedClient>(keystorePath);
+}
+
 void Wallet::EnableLogging(bool enabled, const QString &basePath) {
 	External::EnableLogging(enabled, basePath);
 }
@@ -83,9 +146,34 @@ void Wallet::LogMessage(const QString &message) {
 }
 
 bool Wallet::CheckAddress(const QString &address) {
-	return RequestSender::Execute(TLUnpackAccountAddress(
-		tl_string(address)
-	)) ? true : false;
+	return details::ParseAddress(address).has_value();
+}
+
+std::optional<Address> Wallet::ParseAddress(const QString &address) {
+	if (const auto parsed = details::ParseAddress(address)) {
+		return parsed->raw;
+	}
+	return std::nullopt;
+}
+
+QString Wallet::FormatAddress(
+		const Address &address,
+		bool bounceable,
+		bool testnet) {
+	auto full = AccountAddress();
+	full.raw = address;
+	full.bounceable = bounceable;
+	full.testnet = testnet;
+	return details::FormatAddress(full);
+}
+
+std::vector<bool> Wallet::CheckAddresses(
+		const std::vector<QString> &addresses) {
+	return ranges::view::all(
+		addresses
+	) | ranges::view::transform([](const QString &address) {
+		return details::ParseAddress(address).has_value();
+	}) | ranges::to_vector;
 }
 
 base::flat_set<QString> Wallet::GetValidWords() {
@@ -156,10 +244,18 @@ QString Wallet::getDefaultAddress(
 		int revision) const {
 	Expects(_configInfo.has_value());
 
-	return RequestSender::Execute(TLGetAccountAddress(
+	// The address is a hash of the contract state, so it still needs
+	// tonlib, but it never changes for the same key and wallet id.
+	const auto walletId = _configInfo->walletId;
+	const auto key = DefaultAddressKey{ publicKey, revision, walletId };
+	const auto i = _defaultAddresses.find(key);
+	if (i != end(_defaultAddresses)) {
+		return i->second;
+	}
+	const auto result = RequestSender::Execute(TLGetAccountAddress(
 		tl_wallet_v3_initialAccountState(
 			tl_string(publicKey),
-			tl_int64(_configInfo->walletId + kDefaultWorkchainId)),
+			tl_int64(walletId + kDefaultWorkchainId)),
 		tl_int32(revision),
 		tl_int32(kDefaultWorkchainId)
 	)).value_or(
@@ -167,6 +263,10 @@ QString Wallet::getDefaultAddress(
 	).match([&](const TLDaccountAddress &data) {
 		return tl::utf16(data.vaccount_address());
 	});
+	if (!result.isEmpty()) {
+		_defaultAddresses.emplace(key, result);
+	}
+	return result;
 }
 
 const Settings &Wallet::settings() const {
@@ -193,6 +293,10 @@ void Wallet::updateSettings(Settings settings, Callback<> done) {
 	if (!change) {
 		_external->updateSettings(settings, finish);
 		return;
+	} else if (_external->lib().shared()) {
+		// Switching the network logs out of all the wallets on the client.
+		InvokeCallback(done, details::SharedClientError());
+		return;
 	}
 	// First just save the new settings.
 	settings.useTestNetwork = was.useTestNetwork;
@@ -237,6 +341,43 @@ rpl::producer<Update> Wallet::updates() const {
 	return _updates.events();
 }
 
+rpl::producer<bool> Wallet::requestsQueueFull() const {
+	return _external->lib().queueFull();
+}
+
+RequestsMetrics Wallet::requestsMetrics() const {
+	const auto convert = [](const LatencyHistogram &histogram) {
+		auto result = RequestsLatency();
+		const auto &bounds = LatencyHistogram::kBounds;
+		result.bounds.assign(begin(bounds), end(bounds));
+		result.buckets.assign(
+			begin(histogram.buckets),
+			end(histogram.buckets));
+		result.count = histogram.count;
+		result.total = histogram.total;
+		result.max = histogram.max;
+		return result;
+	};
+	const auto snapshot = _external->lib().metrics();
+	auto result = RequestsMetrics();
+	result.functions.reserve(snapshot.functions.size());
+	for (const auto &[functionId, metrics] : snapshot.functions) {
+		auto &function = result.functions.emplace_back();
+		function.functionId = functionId;
+		function.name = metrics.name;
+		function.latency = convert(metrics.latency);
+		function.handler = convert(metrics.handler);
+		function.requests = metrics.requests;
+		function.resends = metrics.resends;
+		function.timeouts = metrics.timeouts;
+	}
+	result.mainHop = convert(snapshot.mainHop);
+	result.resends = snapshot.resends;
+	result.inFlight = snapshot.inFlight;
+	result.queued = snapshot.queued;
+	return result;
+}
+
 std::vector<QByteArray> Wallet::publicKeys() const {
 	return _list->entries | ranges::view::transform(
 		&WalletList::Entry::publicKey
@@ -402,6 +543,7 @@ void Wallet::deleteAllKeys(Callback<> done) {
 	_keyDestroyer = std::make_unique<KeyDestroyer>(
 		&_external->lib(),
 		&_external->db(),
+		*_list,
 		settings().useTestNetwork,
 		std::move(removed));
 }
@@ -449,41 +591,7 @@ void Wallet::checkSendGrams(
 	const auto sender = getUsedAddress(publicKey);
 	Assert(!sender.isEmpty());
 
-	const auto check = [=](int64 id) {
-		_external->lib().request(TLquery_EstimateFees(
-			tl_int53(id),
-			tl_boolTrue()
-		)).done([=](const TLquery_Fees &result) {
-			_external->lib().request(TLquery_Forget(
-				tl_int53(id)
-			)).send();
-			InvokeCallback(done, Parse(result));
-		}).fail([=](const TLError &error) {
-			InvokeCallback(done, ErrorFromLib(error));
-		}).send();
-	};
-	_external->lib().request(TLCreateQuery(
-		tl_inputKeyFake(),
-		tl_accountAddress(tl_string(sender)),
-		tl_int32(transaction.timeout),
-		tl_actionMsg(
-			tl_vector(1, tl_msg_message(
-				tl_accountAddress(tl_string(transaction.recipient)),
-				tl_string(),
-				tl_int64(transaction.amount),
-				(transaction.sendUnencryptedText
-					? tl_msg_dataText
-					: tl_msg_dataDecryptedText)(
-						tl_string(transaction.comment)))),
-			tl_from(transaction.allowSendToUninited)),
-		tl_raw_initialAccountState(tl_bytes(), tl_bytes()) // doesn't matter
-	)).done([=](const TLquery_Info &result) {
-		result.match([&](const TLDquery_info &data) {
-			check(data.vid().v);
-		});
-	}).fail([=](const TLError &error) {
-		InvokeCallback(done, ErrorFromLib(error));
-	}).send();
+	CheckSendGrams(&_external->lib(), sender, transaction, done);
 }
 
 void Wallet::sendGrams(
@@ -504,7 +612,7 @@ void Wallet::sendGrams(
 			InvokeCallback(done);
 		}).fail([=](const TLError &error) {
 			InvokeCallback(done, ErrorFromLib(error));
-		}).send();
+		}).priority(RequestPriority::Interactive).send();
 	};
 
 	_external->lib().request(TLCreateQuery(
@@ -538,7 +646,7 @@ void Wallet::sendGrams(
 		});
 	}).fail([=](const TLError &error) {
 		InvokeCallback(ready, ErrorFromLib(error));
-	}).send();
+	}).priority(RequestPriority::Interactive).send();
 }
 
 void Wallet::requestState(
@@ -550,23 +658,96 @@ void Wallet::requestState(
 		InvokeCallback(done, Parse(result));
 	}).fail([=](const TLError &error) {
 		InvokeCallback(done, ErrorFromLib(error));
-	}).send();
+	}).priority(
+		RequestPriority::Background
+	).timeout(kRefreshRequestTimeout).coalesce().send();
+}
+
+void Wallet::requestStates(
+		const std::vector<QString> &addresses,
+		Fn<void(int, Result<AccountState>)> done) {
+	auto requests = ranges::view::all(
+		addresses
+	) | ranges::view::transform([](const QString &address) {
+		return TLGetAccountState(tl_accountAddress(tl_string(address)));
+	}) | ranges::to_vector;
+	_external->lib().requestBatch(std::move(requests), [=](
+			std::vector<BatchResult<TLFullAccountState>> results) {
+		for (const auto &entry : results) {
+			if (entry.result) {
+				done(entry.index, Parse(*entry.result));
+			} else {
+				done(entry.index, entry.result.error());
+			}
+		}
+	}, kStatesChunkSize, RequestPriority::Background, kRefreshRequestTimeout);
 }
 
 void Wallet::requestTransactions(
 		const QByteArray &publicKey,
 		const QString &address,
 		const TransactionId &lastId,
-		Callback<TransactionsSlice> done) {
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard) {
+	requestTransactionsFromNetwork(address, lastId, false, done, guard);
+}
+
+void Wallet::requestHistoryTransactions(
+		const QByteArray &publicKey,
+		const QString &address,
+		const TransactionId &lastId,
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard) {
+	if (!lastId.lt) {
+		requestTransactionsFromNetwork(address, lastId, false, done, guard);
+		return;
+	}
+	auto weak = guard
+		? std::make_optional(base::make_weak(guard))
+		: std::nullopt;
+	const auto loaded = [=](std::optional<TransactionsSlice> &&slice) {
+		if (weak && !*weak) {
+			return;
+		} else if (slice) {
+			InvokeCallback(done, std::move(*slice));
+			return;
+		}
+		requestTransactionsFromNetwork(
+			address,
+			lastId,
+			true,
+			done,
+			weak ? weak->get() : nullptr);
+	};
+	LoadTransactionsPage(&_external->db(), address, lastId, this, loaded);
+}
+
+void Wallet::requestTransactionsFromNetwork(
+		const QString &address,
+		const TransactionId &lastId,
+		bool savePage,
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard) {
 	_external->lib().request(TLraw_GetTransactions(
 		tl_inputKeyFake(),
 		tl_accountAddress(tl_string(address)),
 		tl_internal_transactionId(tl_int64(lastId.lt), tl_bytes(lastId.hash))
 	)).done([=](const TLraw_Transactions &result) {
-		InvokeCallback(done, Parse(result));
+		auto slice = Parse(result);
+		if (savePage) {
+			SaveTransactionsPage(
+				&_external->db(),
+				address,
+				lastId,
+				slice,
+				nullptr);
+		}
+		InvokeCallback(done, std::move(slice));
 	}).fail([=](const TLError &error) {
 		InvokeCallback(done, ErrorFromLib(error));
-	}).send();
+	}).priority(
+		RequestPriority::Background
+	).timeout(kRefreshRequestTimeout).guard(guard).send();
 }
 
 void Wallet::trySilentDecrypt(
@@ -687,6 +868,35 @@ std::unique_ptr<AccountViewer> Wallet::createAccountViewer(
 	return _accountViewers->createAccountViewer(publicKey, address);
 }
 
+void Wallet::preloadViewersStates() {
+	auto addresses = std::vector<QString>();
+	addresses.reserve(_list->entries.size());
+	for (const auto &entry : _list->entries) {
+		if (!entry.address.isEmpty()) {
+			addresses.push_back(entry.address);
+		} else if (_configInfo) {
+			addresses.push_back(getUsedAddress(entry.publicKey));
+		}
+	}
+	_accountViewers->preloadStates(addresses);
+}
+
+void Wallet::exportHistorySnapshot(
+		const QString &address,
+		const QString &path,
+		Callback<> done) {
+	_accountViewers->flushSaves();
+	auto loaded = [=](std::vector<Transaction> &&list) {
+		crl::async([=, list = std::move(list)] {
+			auto result = WriteHistorySnapshot(path, list);
+			crl::on_main(this, [=, result = std::move(result)] {
+				InvokeCallback(done, result);
+			});
+		});
+	};
+	LoadStoredHistory(&_external->db(), address, this, loaded);
+}
+
 void Wallet::updateViewersPassword(
 		const QByteArray &publicKey,
 		const QByteArray &password) {
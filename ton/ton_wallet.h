@@ -19,6 +19,7 @@ namespace Ton {
 namespace details {
 struct WalletList;
 class External;
+class SharedClient;
 class KeyCreator;
 class KeyDestroyer;
 class PasswordChanger;
@@ -37,8 +38,18 @@ class AccountViewer;
 class Wallet final : public base::has_weak_ptr {
 public:
 	explicit Wallet(const QString &path);
+
+	// Wallets created with the same client share one tonlib instance,
+	// its keystore in the given directory and its network connections.
+	// They must all use the same network and config.
+	Wallet(
+		const QString &path,
+		std::shared_ptr<details::SharedClient> client);
 	~Wallet();
 
+	[[nodiscard]] static auto CreateSharedClient(const QString &keystorePath)
+	-> std::shared_ptr<details::SharedClient>;
+
 	void open(
 		const QByteArray &globalPassword,
 		const Settings &defaultSettings,
@@ -54,6 +65,13 @@ public:
 
 	[[nodiscard]] rpl::producer<Update> updates() const;
 
+	// True while too many requests wait to be sent, callers may want
+	// to hold off non-urgent work like preloading more history.
+	[[nodiscard]] rpl::producer<bool> requestsQueueFull() const;
+
+	// Counters since the start, for monitoring. Cheap, may be polled.
+	[[nodiscard]] RequestsMetrics requestsMetrics() const;
+
 	[[nodiscard]] std::vector<QByteArray> publicKeys() const;
 
 	void createKey(Callback<std::vector<QString>> done);
@@ -88,12 +106,32 @@ public:
 	static void EnableLogging(bool enabled, const QString &basePath);
 	static void LogMessage(const QString &message);
 	[[nodiscard]] static bool CheckAddress(const QString &address);
+	[[nodiscard]] static std::optional<Address> ParseAddress(
+		const QString &address);
+	[[nodiscard]] static QString FormatAddress(
+		const Address &address,
+		bool bounceable = true,
+		bool testnet = false);
+	[[nodiscard]] static std::vector<bool> CheckAddresses(
+		const std::vector<QString> &addresses);
 	[[nodiscard]] static base::flat_set<QString> GetValidWords();
 	[[nodiscard]] static bool IsIncorrectPasswordError(const Error &error);
 
 	[[nodiscard]] std::unique_ptr<AccountViewer> createAccountViewer(
 		const QByteArray &publicKey,
 		const QString &address);
+
+	// Optional, after open(). Loads stored states of all the wallets at
+	// once, so their viewers show balances without database round trips.
+	// Legacy wallets without a saved address are skipped before start().
+	void preloadViewersStates();
+
+	// Writes the locally cached history of the address in the layout
+	// described in ton_history_snapshot.h, without network requests.
+	void exportHistorySnapshot(
+		const QString &address,
+		const QString &path,
+		Callback<> done);
 	void updateViewersPassword(
 		const QByteArray &publicKey,
 		const QByteArray &password);
@@ -111,13 +149,26 @@ public:
 
 	// Internal API.
 	void requestState(const QString &address, Callback<AccountState> done);
+	void requestStates(
+		const std::vector<QString> &addresses,
+		Fn<void(int, Result<AccountState>)> done);
 	void requestTransactions(
 		const QByteArray &publicKey,
 		const QString &address,
 		const TransactionId &lastId,
-		Callback<TransactionsSlice> done);
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard = nullptr);
+
+	// Older history pages, looked up in the local cache first.
+	void requestHistoryTransactions(
+		const QByteArray &publicKey,
+		const QString &address,
+		const TransactionId &lastId,
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard = nullptr);
 
 private:
+	using DefaultAddressKey = std::tuple<QByteArray, int, int64>;
 	struct ViewersPassword {
 		QByteArray bytes;
 		int generation = 1;
@@ -135,6 +186,13 @@ private:
 		const QByteArray &publicKey,
 		int revision) const;
 
+	void requestTransactionsFromNetwork(
+		const QString &address,
+		const TransactionId &lastId,
+		bool savePage,
+		Callback<TransactionsSlice> done,
+		const base::has_weak_ptr *guard);
+
 	void handleInputKeyError(
 		const QByteArray &publicKey,
 		int generation,
@@ -142,6 +200,7 @@ private:
 		Callback<> done);
 
 	std::optional<ConfigInfo> _configInfo;
+	mutable base::flat_map<DefaultAddressKey, QString> _defaultAddresses;
 	rpl::event_stream<Update> _updates;
 	SyncState _lastSyncStateUpdate;
 	bool _switchedToMain = false;